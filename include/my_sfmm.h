@@ -1,8 +1,39 @@
 #ifndef MY_SFMM_H
 #define MY_SFMM_H
+
+#include <stdio.h>
+
+/*
+ * Block format.  A free block needs room for its header, both links and its footer, so
+ * it can never be smaller than MIN_FREE_BLOCK_SIZE.  Allocated blocks only need a header,
+ * and with SF_COMPACT_BLOCKS (make compact) they shrink to a header and one row of
+ * payload.  Freed blocks below MIN_FREE_BLOCK_SIZE keep a header and footer but stay off
+ * the free lists until coalescing with a neighbour makes them big enough.
+ */
+#define MIN_FREE_BLOCK_SIZE 32
+#ifdef SF_COMPACT_BLOCKS
+#define MIN_BLOCK_SIZE 16
+#else
+#define MIN_BLOCK_SIZE MIN_FREE_BLOCK_SIZE
 #endif
 
+/*
+ * Compile-time versions of calculate_aligned_block_size and get_size_class, for sizes
+ * up to SF_INLINE_MAX_SIZE.  Used by the constant-size sf_malloc in sfmm_inline.h.
+ * SF_SIZE_CLASS follows the default class limits, which sfclasses.c also builds its
+ * table from; sf_malloc_class ignores it once the limits have been adapted.
+ */
+#define SF_INLINE_MAX_SIZE 1016
+#define SF_DEFAULT_CLASS_LIMIT(i) ((size_t) 32 << (i))
+#define SF_BLOCK_SIZE(size) ((size) + 8 < MIN_BLOCK_SIZE ? (size_t) MIN_BLOCK_SIZE \
+	: ((size_t) (size) + 8 + 15) & ~(size_t) 15)
+#define SF_SIZE_CLASS(block_size) ((block_size) <= SF_DEFAULT_CLASS_LIMIT(0) ? 0 \
+	: (block_size) <= SF_DEFAULT_CLASS_LIMIT(1) ? 1 : (block_size) <= SF_DEFAULT_CLASS_LIMIT(2) ? 2 \
+	: (block_size) <= SF_DEFAULT_CLASS_LIMIT(3) ? 3 : (block_size) <= SF_DEFAULT_CLASS_LIMIT(4) ? 4 \
+	: (block_size) <= SF_DEFAULT_CLASS_LIMIT(5) ? 5 : 6)
+
 void initialize_heap();
+void format_heap();
 void allocate_prologue();
 void allocate_epilogue();
 sf_header create_header(size_t block_size, int prv_alloc, int alloc);
@@ -11,6 +42,17 @@ void insert_into_free_list(sf_block *block, sf_block *list_head);
 void initialize_free_lists();
 size_t calculate_aligned_block_size(size_t size);
 sf_block *find_free_block(size_t size);
+sf_block *find_free_block_from(size_t size, int size_class);
+int get_size_class(size_t size);
+void record_block_size(size_t block_size);
+void rebuild_size_classes();
+int size_in(size_t size, size_t *sizes, int count);
+void migrate_free_blocks();
+extern int size_classes_adapted;
+extern int size_classes_stale;
+void *sf_malloc_class(size_t size, size_t block_size, int size_class);
+sf_block *pop_size_class(size_t size, int size_class);
+void carve_block(sf_block *free_block, size_t block_size);
 sf_block *search_free_list(sf_block *head, size_t size);
 int check_enough_space(sf_block block, size_t required_size);
 sf_block *coalesce(sf_block *block);
@@ -18,6 +60,9 @@ void remove_from_free_list(sf_block *block);
 sf_block *expand_heap_to_fit(size_t size);
 sf_block *split_block(sf_block *block);
 void allocate_block(sf_block *block, size_t size);
+sf_block *place_block(sf_block *free_block, size_t block_size);
+void allocate_from_wilderness(sf_block *wilderness, size_t size);
+void write_wilderness_footer();
 sf_block *get_relevant_free_list_head(size_t size, void *block);
 void set_prev_allocation_flag(sf_block *block, int prev_allocation);
 
@@ -26,6 +71,7 @@ int valid_pointer(void *pp);
 
 
 
+void *realloc_block(void *pp, size_t rsize);
 void *sf_realloc_larger(sf_block *block, size_t rsize);
 void *sf_realloc_smaller(sf_block *block, size_t rsize);
 
@@ -35,4 +81,410 @@ int is_power_of_two(size_t val);
 void *find_address_with_alignment(void *addr, size_t align);
 
 
-int power(int base, int exp);
\ No newline at end of file
+
+/*
+ * Thread safety (SF_THREADS, make threads).  Each free list has its own lock, held while
+ * the list is searched or relinked and while the headers and footers of the free blocks
+ * on it are written, so allocating a block (finding it, splitting it and putting the
+ * remainder on its list) only takes the locks of the lists involved, and threads using
+ * different size classes never wait on each other.  Coalescing takes the boundary lock
+ * for its boundary-tag reads and writes: a neighbour it finds free is only merged after
+ * its list's lock shows it is still free and the same size, since it may have been
+ * allocated in the meantime.  The heap only grows under the grow lock.  Whole-heap
+ * operations (compaction, snapshots, purging, hints and the like) take every lock with
+ * LOCK_HEAP.  Locks are taken in the order grow, boundary, then lists from the highest
+ * to the lowest, and a thread may take a lock again while it holds it.  Without
+ * SF_THREADS the locks compile away.
+ */
+#ifdef SF_THREADS
+#define SF_THREAD_LOCAL __thread
+#define LOCK_GROW() lock_grow()
+#define UNLOCK_GROW() unlock_grow()
+#define LOCK_BOUNDARY() lock_boundary()
+#define UNLOCK_BOUNDARY() unlock_boundary()
+#define LOCK_LIST(list) lock_list(list)
+#define UNLOCK_LIST(list) unlock_list(list)
+#define LOCK_HEAP() lock_heap()
+#define UNLOCK_HEAP() unlock_heap()
+#define READ_TAG(tag) __atomic_load_n(&(tag), __ATOMIC_ACQUIRE) /* Written under another lock */
+#define WRITE_TAG(tag, value) __atomic_store_n(&(tag), value, __ATOMIC_RELEASE)
+#define INCREMENT(counter) __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+void lock_grow();
+void unlock_grow();
+void lock_boundary();
+void unlock_boundary();
+void lock_list(int list);
+void unlock_list(int list);
+void lock_heap();
+void unlock_heap();
+#else
+#define SF_THREAD_LOCAL
+#define LOCK_GROW()
+#define UNLOCK_GROW()
+#define LOCK_BOUNDARY()
+#define UNLOCK_BOUNDARY()
+#define LOCK_LIST(list)
+#define UNLOCK_LIST(list)
+#define LOCK_HEAP()
+#define UNLOCK_HEAP()
+#define READ_TAG(tag) (tag)
+#define WRITE_TAG(tag, value) ((tag) = (value))
+#define INCREMENT(counter) (++(counter))
+#endif
+
+void initialize_allocator();
+sf_block *claim_free_block(size_t size, int size_class);
+sf_block *take_free_block(size_t size, int size_class);
+sf_block *fit_in_list(int list, size_t size, int size_class);
+int free_list_of(size_t size, void *block);
+sf_block *unlink_free_prev(sf_block *block);
+sf_block *unlink_free_next(sf_block *block);
+int unlink_if_unchanged(sf_block *block, sf_header header);
+
+
+
+
+/*
+ * Lifetime hints for sf_malloc_hint.
+ *
+ * SF_HINT_SHORT: the block is expected to be freed soon.
+ * SF_HINT_LONG: the block is expected to live for most of the program.
+ * SF_HINT_HOT: the block is accessed together with other hot blocks.
+ */
+#define SF_HINT_SHORT 0x1
+#define SF_HINT_LONG  0x2
+#define SF_HINT_HOT   0x4
+
+/*
+ * Allocates like sf_malloc, but places the block according to the lifetime hints so that
+ * blocks with different expected lifetimes do not fragment each other.
+ *
+ * @param size The number of bytes requested to be allocated.
+ * @param hints A combination of the SF_HINT_* flags, or 0 for sf_malloc placement.
+ *
+ * @return Same as sf_malloc.
+ */
+void *sf_malloc_hint(size_t size, int hints);
+sf_block *find_hot_block(size_t size);
+sf_block *find_lowest_free_block(size_t size);
+void forget_placement_hints();
+sf_block *place_block_at_tail(sf_block *free_block, size_t block_size);
+
+
+/*
+ * Heap snapshots: a compact binary dump of the block layout that can be
+ * analyzed offline.  The stream is a sf_snapshot_header, followed by
+ * NUM_FREE_LISTS 64-bit free list lengths, followed by num_blocks
+ * sf_snapshot_block records in heap order.  A block's free_list is the list it
+ * was actually found on by walking the free lists (-1 if none), and
+ * expected_list is the list its size belongs in (-1 for allocated blocks and
+ * free blocks too small to be listed).  List entries that are not the start of
+ * a block are counted in stray_entries.  Offsets are relative to
+ * sf_mem_start(), so snapshots taken in different processes compare directly.
+ * Requested sizes are not recorded, so padding inside allocated blocks counts
+ * as allocated.
+ */
+#define SF_SNAPSHOT_MAGIC "SFSNAP2"
+#define SF_SNAPSHOT_DUPLICATE 0x8 /* Block is on the free lists more than once */
+
+struct sf_snapshot_header {
+	char magic[8];
+	uint64_t heap_size;
+	uint64_t num_blocks;
+	uint64_t stray_entries;
+};
+
+struct sf_snapshot_block {
+	uint64_t offset;     /* Offset of the block header from sf_mem_start() */
+	uint32_t size;       /* Block size in 16-byte units */
+	uint8_t flags;       /* THIS_BLOCK_ALLOCATED, PREV_BLOCK_ALLOCATED, SF_SNAPSHOT_DUPLICATE */
+	int8_t free_list;    /* Free list the block is on, -1 if none */
+	int8_t expected_list; /* Free list the block belongs on, -1 if none */
+	uint8_t reserved;
+};
+
+struct sf_snapshot_report {
+	size_t heap_size;
+	size_t allocated_blocks;
+	size_t allocated_bytes;      /* Including padding inside the blocks */
+	size_t free_blocks;
+	size_t free_bytes;
+	size_t largest_free_block;
+	size_t header_bytes;         /* 8 bytes of header per block */
+	size_t overhead_bytes;       /* Heap padding, prologue and epilogue */
+	size_t class_free_blocks[NUM_FREE_LISTS];
+	size_t class_free_bytes[NUM_FREE_LISTS];
+	size_t list_lengths[NUM_FREE_LISTS];
+	size_t unlisted_blocks;      /* Free blocks on no list */
+	size_t misfiled_blocks;      /* Blocks on a list they do not belong on */
+	size_t duplicate_blocks;     /* Blocks on the lists more than once */
+	size_t stray_entries;        /* List entries that are not blocks */
+	size_t fragment_blocks;      /* Free blocks too small for any list */
+};
+
+int sf_heap_snapshot(int fd);
+int write_heap_snapshot(int fd);
+int write_snapshot_blocks(int fd, struct sf_snapshot_header *header, uint64_t *list_lengths, uint8_t *marks);
+uint64_t mark_listed_blocks(uint8_t *marks, uint64_t *list_lengths);
+int sf_snapshot_analyze(int fd, struct sf_snapshot_report *report);
+void sf_snapshot_print_report(FILE *out, struct sf_snapshot_report *report);
+int write_fully(int fd, void *buf, size_t len);
+int read_fully(int fd, void *buf, size_t len);
+
+
+/*
+ * Persistent heaps.  sf_heap_save writes the heap, the free list heads and up to
+ * SF_NUM_ROOTS root pointers to a file, with every link stored as an offset from the
+ * start of the heap.  A later process calls sf_heap_restore before its first sf_malloc
+ * to load the image into its own heap and pick up its root objects with sf_get_root.
+ */
+#define SF_HEAP_IMAGE_MAGIC "SFHEAP1"
+#define SF_NUM_ROOTS 16
+
+struct sf_heap_image_header {
+	char magic[8];
+	uint64_t heap_size;
+	uint64_t list_links[NUM_FREE_LISTS][2]; /* next and prev of each list head */
+	uint64_t roots[SF_NUM_ROOTS];
+};
+
+int sf_set_root(int index, void *ptr);
+void *sf_get_root(int index);
+int sf_heap_save(int fd);
+int sf_heap_restore(int fd);
+int load_heap_image(int fd);
+int validate_heap_image(struct sf_heap_image_header *header, void *image);
+void translate_free_links(int to_offsets);
+uint64_t link_to_offset(sf_block *link);
+sf_block *offset_to_link(uint64_t offset);
+
+
+/*
+ * Allocation tracing.  sf_trace_start(fd) records every sf_malloc, sf_malloc_hint,
+ * sf_free, sf_realloc and sf_memalign call as a binary sf_trace_record written to fd,
+ * until sf_trace_stop.  Pointers are recorded as offsets from sf_mem_start(), and
+ * sf_trace_decode (bin/sfdecode) turns a recording into a replayable text trace.  In
+ * SF_THREADS builds sf_trace_flush and sf_trace_stop write out the records of every
+ * thread, and a thread that exits writes out its own.
+ */
+#define SF_TRACE_MALLOC   1
+#define SF_TRACE_FREE     2
+#define SF_TRACE_REALLOC  3
+#define SF_TRACE_MEMALIGN 4
+#define SF_TRACE_NULL UINT64_MAX /* Offset recorded for a NULL pointer */
+
+struct sf_trace_record {
+	uint64_t timestamp;   /* CLOCK_MONOTONIC nanoseconds */
+	uint64_t size;        /* Requested size */
+	uint64_t arg;         /* Pointer passed in, alignment, or lifetime hints */
+	uint64_t result;      /* Pointer returned */
+	uint32_t thread;
+	uint16_t op;
+	uint16_t reserved;
+};
+
+extern int sf_trace_active;
+extern SF_THREAD_LOCAL int trace_suppressed; /* Set around the allocator's own calls */
+#define TRACING() (sf_trace_active && !trace_suppressed)
+
+int sf_trace_start(int fd);
+int sf_trace_stop();
+int sf_trace_flush();
+int sf_trace_decode(int fd, FILE *out);
+uint64_t trace_offset(void *ptr);
+uint64_t trace_clock();
+void trace_event(int op, size_t size, uint64_t arg, void *result, uint64_t timestamp);
+void trace_realloc_release();
+void trace_thread_exit(void *ring);
+struct sf_trace_record *read_trace_records(int fd, size_t *num_records);
+void sort_trace_records(struct sf_trace_record *records, struct sf_trace_record *scratch, size_t count);
+void *sf_trace_malloc(size_t size);
+void *sf_trace_malloc_hint(size_t size, int hints);
+void sf_trace_free(void *pp);
+void *sf_trace_realloc(void *pp, size_t rsize);
+void *sf_trace_memalign(size_t size, size_t align);
+uint32_t trace_thread_id();
+
+
+/*
+ * Memory limits and pressure callbacks.
+ *
+ * sf_set_memory_limit(soft, hard): before the heap grows past soft bytes, every
+ * registered pressure callback is called so the application can free cached memory,
+ * and the free lists are searched again before growing.  The heap never grows past hard
+ * bytes; the allocation fails with ENOMEM instead.  A limit of 0 means no limit.
+ * Returns -1 and sets sf_errno to EINVAL if soft is above a nonzero hard limit.
+ *
+ * sf_register_pressure_callback(callback, arg): calls callback(info, arg) under memory
+ * pressure, where info->trim_hint is how many bytes would have to be freed to stay under
+ * the soft limit.  Up to SF_MAX_PRESSURE_CALLBACKS callbacks can be registered.
+ */
+#define SF_MAX_PRESSURE_CALLBACKS 8
+
+struct sf_pressure_info {
+	size_t heap_size;
+	size_t soft_limit;
+	size_t hard_limit;
+	size_t requested;    /* Block size that does not fit */
+	size_t trim_hint;
+};
+
+typedef void (*sf_pressure_callback)(struct sf_pressure_info *info, void *arg);
+
+int sf_set_memory_limit(size_t soft, size_t hard);
+int sf_register_pressure_callback(sf_pressure_callback callback, void *arg);
+size_t heap_growth_needed(size_t size);
+int exceeds_soft_limit(size_t growth);
+int exceeds_hard_limit(size_t growth);
+int relieve_memory_pressure(size_t size, size_t growth);
+
+/*
+ * Movable blocks.  sf_halloc(size) allocates a block the allocator may move and returns
+ * a handle to it, or NULL (sf_errno ENOMEM) if the block or a handle is not available.
+ * sf_hlock(handle) pins the block and returns its current address, which stays valid
+ * until the matching sf_hunlock(handle).  sf_hfree(handle) frees the block and the
+ * handle; like sf_free it aborts on an invalid handle.
+ *
+ * sf_compact() slides every unlocked handle block down into the free block right before
+ * it, so free space collects at the end of the heap and coalesces with the wilderness.
+ * Other blocks and locked handle blocks stay where they are.  Returns the size of the
+ * free block at the end of the heap afterwards.
+ */
+#define SF_MAX_HANDLES 1024
+
+struct sf_handle_entry {
+	void *payload;    /* NULL if the handle is not in use */
+	int locks;
+};
+
+typedef struct sf_handle_entry *sf_handle;
+
+sf_handle sf_halloc(size_t size);
+void *sf_hlock(sf_handle handle);
+void sf_hunlock(sf_handle handle);
+void sf_hfree(sf_handle handle);
+size_t sf_compact();
+int valid_handle(sf_handle handle);
+sf_block *slide_block(sf_block *free_block, sf_block *block);
+
+/*
+ * Cache colouring.  After sf_set_cache_colouring(min_size), successive sf_malloc blocks of
+ * at least min_size bytes return a pointer 0 to SF_NUM_COLOURS - 1 cache lines into
+ * their payload, in rotation, so large buffers stop mapping onto the same cache sets.
+ * The block header is left as sfmm.h defines it.  Instead, the first word of a coloured
+ * block's payload holds its offset with SF_COLOUR_MAGIC set, and the word before the
+ * coloured pointer holds the offset again with SF_COLOUR_MARK set.  That is how sf_free,
+ * sf_realloc and valid_pointer find the header, once both words agree.  Neither word
+ * depends on where the block is, so coloured blocks can be moved by sf_compact and saved
+ * in heap images.  sf_memalign blocks are never coloured, since an offset would undo
+ * their alignment.  A min_size of 0 turns colouring off.
+ */
+#define SF_CACHE_LINE 64
+#define SF_NUM_COLOURS 8
+#define SF_COLOUR_MARK 0x4
+#define SF_COLOUR_MAGIC 0x53464d4d434f0000 /* "SFMMCO", clear of every offset */
+
+extern size_t colour_min_size;
+extern size_t colour_floor; /* Smallest min_size ever set, so no smaller block is coloured */
+
+void sf_set_cache_colouring(size_t min_size);
+void *malloc_block(size_t size);
+void *colour_block(size_t size);
+void *colour_base(void *pp);
+void *sf_realloc_coloured(void *pp, void *base, size_t rsize);
+
+/*
+ * Deferred free for lock-free readers.  Readers bracket every traversal with
+ * sf_epoch_enter() and sf_epoch_exit().  sf_free_deferred(ptr) retires a block that
+ * readers may still be looking at; it is passed to sf_free once every reader that was
+ * inside a traversal when it was retired has left it.  Retired blocks are kept per
+ * thread in batches of SF_EPOCH_BATCH_SIZE, one list for each of the last three epochs,
+ * and the global epoch is advanced each time a batch fills up.  sf_epoch_reclaim()
+ * frees what the calling thread retired that is already safe to free.  In SF_THREADS
+ * builds a thread's reader slot and retired blocks are taken over when it exits.
+ *
+ * sf_epoch_enter returns -1 with sf_errno ENOMEM while SF_MAX_EPOCH_THREADS other running
+ * threads hold a reader slot, and sf_free_deferred returns -1 with sf_errno ENOMEM
+ * (leaving the block allocated) if there is no room for a new batch.  Both return 0
+ * otherwise.
+ */
+#define SF_MAX_EPOCH_THREADS 64
+#define SF_EPOCH_BATCH_SIZE 62
+#define SF_EPOCH_ACTIVE 0x1 /* Reader state: epoch << 1 | SF_EPOCH_ACTIVE */
+
+struct sf_epoch_batch {
+	struct sf_epoch_batch *next;
+	int count;
+	void *blocks[SF_EPOCH_BATCH_SIZE];
+};
+
+int sf_epoch_enter();
+void sf_epoch_exit();
+int sf_free_deferred(void *ptr);
+void sf_epoch_reclaim();
+int try_advance_epoch();
+void free_retired_blocks(int bucket);
+void free_batches(struct sf_epoch_batch *batch);
+void epoch_thread_exit(void *unused);
+
+/*
+ * Huge page segments.  With sf_set_huge_pages(1), the heap grows up to the next
+ * SF_SEGMENT_SIZE boundary instead of by the pages a request needs (as far as the hard
+ * limit allows), and every whole segment-aligned range of the heap is advised to the
+ * kernel with MADV_HUGEPAGE.  sf_huge_page_stats reports how much of the heap is in such
+ * segments, and the size and AnonHugePages (from /proc/self/smaps, 0 where that is not
+ * available) of the mapping containing the heap.  The kernel only reports huge pages per
+ * mapping, and sf_mem_grow's heap shares its mapping with the rest of the process's
+ * malloc heap, so the huge page bytes of the mapping can include memory outside sfmm's
+ * heap.  They are an upper bound on the heap's own, as long as the heap lies in one
+ * mapping.
+ */
+#define SF_SEGMENT_SIZE ((size_t) 2 * 1024 * 1024)
+
+struct sf_huge_page_stats {
+	size_t heap_size;
+	size_t segment_bytes;            /* Bytes in advised segments */
+	size_t mapping_size;             /* Size of the mapping containing the heap */
+	size_t mapping_huge_page_bytes;  /* Bytes of that mapping backed by huge pages */
+};
+
+extern int huge_pages_enabled;
+
+void sf_set_huge_pages(int enabled);
+int sf_huge_page_stats(struct sf_huge_page_stats *stats);
+void *segment_end_for(size_t size);
+int grow_for_segment(void *segment_end);
+void advise_huge_pages();
+void read_mapping_stats(void *addr, struct sf_huge_page_stats *stats);
+
+/*
+ * Purging.  Free blocks of at least SF_PURGE_MIN_SIZE bytes record when they were put on
+ * a free list in the word after their links, with SF_PURGED set once their pages are
+ * gone.  sf_purge(min_idle_ms) hands the whole pages inside blocks idle that long back to
+ * the kernel with MADV_DONTNEED; the header, links, idle stamp and footer stay resident,
+ * and the pages read back as zeros.  After sf_set_purge_decay(ms), every
+ * SF_PURGE_INTERVAL calls to sf_free purge the blocks idle for ms; a negative decay (the
+ * default) turns that off.  With huge pages on, only whole segments are purged.
+ */
+#define SF_PURGE_MIN_SIZE PAGE_SZ
+#define SF_PURGE_INTERVAL 64
+#define SF_PURGED 0x1
+
+void sf_set_purge_decay(long decay_ms);
+size_t sf_purge(long min_idle_ms);
+void stamp_free_block(sf_block *block);
+void maybe_purge();
+size_t purge_block(sf_block *block, uint64_t now, long min_idle_ms);
+
+/*
+ * Sized free.  sf_free_sized(ptr, size) frees a block from sf_malloc(size),
+ * sf_realloc(ptr, size) or sf_memalign(size, align) without validating it first, for
+ * callers that keep track of their sizes anyway (include/sfmm.hpp).  The size also
+ * spares blocks too small to have been coloured the colour lookup.  Debug builds still
+ * validate the pointer and check the size against the header; elsewhere, passing
+ * anything else is undefined.
+ */
+void sf_free_sized(void *ptr, size_t size);
+void release_block(sf_block *block);
+
+#endif /* MY_SFMM_H */
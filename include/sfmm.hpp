@@ -0,0 +1,103 @@
+#ifndef SFMM_HPP
+#define SFMM_HPP
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+/*
+ * C++ adapters (C++17).  sfmm.h defines sf_errno and the free list heads itself, so the
+ * functions used here are declared again instead of including it.
+ *
+ * Both adapters hand the size they get back on deallocation to sf_free_sized, and send
+ * anything aligned to more than SF_MALLOC_ALIGNMENT to sf_memalign, which takes no
+ * alignment below 32.
+ */
+extern "C" {
+void *sf_malloc(std::size_t size);
+void *sf_memalign(std::size_t size, std::size_t align);
+void sf_free_sized(void *ptr, std::size_t size);
+}
+
+namespace sfmm {
+
+constexpr std::size_t SF_MALLOC_ALIGNMENT = 16;
+constexpr std::size_t SF_MIN_MEMALIGN = 32;
+
+inline void *allocate_bytes(std::size_t bytes, std::size_t align) {
+	if (bytes == 0) {
+		bytes = 1; /* sf_malloc(0) is NULL, new never is */
+	}
+	void *ptr;
+	if (align <= SF_MALLOC_ALIGNMENT) {
+		ptr = sf_malloc(bytes);
+	} else {
+		ptr = sf_memalign(bytes, align < SF_MIN_MEMALIGN ? SF_MIN_MEMALIGN : align);
+	}
+	if (ptr == nullptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+inline void deallocate_bytes(void *ptr, std::size_t bytes) {
+	sf_free_sized(ptr, bytes == 0 ? 1 : bytes);
+}
+
+/* Every memory_resource shares the one sfmm heap, so any two compare equal. */
+class memory_resource : public std::pmr::memory_resource {
+private:
+	void *do_allocate(std::size_t bytes, std::size_t align) override {
+		return allocate_bytes(bytes, align);
+	}
+
+	void do_deallocate(void *ptr, std::size_t bytes, std::size_t align) override {
+		deallocate_bytes(ptr, bytes);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+		return dynamic_cast<const memory_resource *>(&other) != nullptr;
+	}
+};
+
+inline memory_resource *get_memory_resource() {
+	static memory_resource resource;
+	return &resource;
+}
+
+template <typename T>
+class allocator {
+public:
+	using value_type = T;
+
+	allocator() noexcept = default;
+
+	template <typename U>
+	allocator(const allocator<U> &) noexcept {}
+
+	T *allocate(std::size_t n) {
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+			throw std::bad_array_new_length();
+		}
+		return static_cast<T *>(allocate_bytes(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *ptr, std::size_t n) noexcept {
+		deallocate_bytes(ptr, n * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+	return false;
+}
+
+} /* namespace sfmm */
+
+#endif /* SFMM_HPP */
@@ -0,0 +1,17 @@
+#ifndef SFMM_INLINE_H
+#define SFMM_INLINE_H
+
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Include this header instead of sfmm.h to let sf_malloc calls with a small compile-time
+ * constant size, such as sf_malloc(sizeof(struct foo)), skip the size calculation and
+ * take a block straight off their own size class list.  Every other call goes to
+ * sf_malloc as usual.
+ */
+#define sf_malloc(size) (__builtin_constant_p(size) && (size) != 0 && (size) <= SF_INLINE_MAX_SIZE \
+	? sf_malloc_class((size), SF_BLOCK_SIZE(size), SF_SIZE_CLASS(SF_BLOCK_SIZE(size))) \
+	: (sf_malloc)(size))
+
+#endif /* SFMM_INLINE_H */
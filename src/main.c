@@ -1,5 +1,5 @@
 #include <stdio.h>
-#include "sfmm.h"
+#include "sfmm_inline.h"
 
 int main(int argc, char const *argv[]) {
     double* ptr = sf_malloc(sizeof(double));
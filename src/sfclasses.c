@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Size classes.  List i < 6 holds the free blocks whose size is in
+ * (class_limits[i-1], class_limits[i]] and list 6 everything larger than class_limits[5];
+ * the wilderness list is chosen by position, not size.  The limits start out as the
+ * power-of-two ranges from 32 to 1024.  Every CLASS_REBUILD_INTERVAL allocations the
+ * histogram of requested block sizes is checked for hot sizes, and each hot size gets a
+ * class of its own by placing limits right below and at it.  Free blocks are moved to
+ * their new lists by the next search of the free lists, or right away in SF_THREADS
+ * builds.
+ */
+#define NUM_CLASS_LIMITS (NUM_FREE_LISTS - 2)
+#define HISTOGRAM_MAX_SIZE 4096          /* Larger blocks are not tracked */
+#define CLASS_REBUILD_INTERVAL 4096      /* Allocations between rebuilds */
+#define MAX_HOT_SIZES 3
+#define HOT_SIZE_SHARE 8                 /* Hot sizes make up at least 1/8 of requests */
+
+#define DEFAULT_CLASS_LIMITS { SF_DEFAULT_CLASS_LIMIT(0), SF_DEFAULT_CLASS_LIMIT(1), SF_DEFAULT_CLASS_LIMIT(2), \
+	SF_DEFAULT_CLASS_LIMIT(3), SF_DEFAULT_CLASS_LIMIT(4), SF_DEFAULT_CLASS_LIMIT(5) }
+
+static const size_t default_class_limits[NUM_CLASS_LIMITS] = DEFAULT_CLASS_LIMITS;
+static const int default_limit_priority[NUM_CLASS_LIMITS] = { 5, 3, 1, 4, 2, 0 };
+static size_t class_limits[NUM_CLASS_LIMITS] = DEFAULT_CLASS_LIMITS;
+static unsigned int size_histogram[HISTOGRAM_MAX_SIZE / 16 + 1];
+static unsigned int histogram_samples = 0;
+int size_classes_adapted = 0;
+int size_classes_stale = 0;
+
+int get_size_class(size_t size) {
+	int size_class = 0;
+	while (size_class < NUM_CLASS_LIMITS && size > class_limits[size_class]) {
+		size_class++;
+	}
+	return size_class;
+}
+
+void record_block_size(size_t block_size) {
+	if (block_size <= HISTOGRAM_MAX_SIZE) {
+		INCREMENT(size_histogram[block_size / 16]);
+	}
+	if (INCREMENT(histogram_samples) >= CLASS_REBUILD_INTERVAL) {
+		LOCK_HEAP();
+		if (histogram_samples >= CLASS_REBUILD_INTERVAL) { /* Another thread may have rebuilt them */
+			rebuild_size_classes();
+#ifdef SF_THREADS
+			if (size_classes_stale) { /* A free block's list lock is found from its size class */
+				migrate_free_blocks();
+			}
+#endif
+			memset(size_histogram, 0, sizeof(size_histogram));
+			histogram_samples = 0;
+		}
+		UNLOCK_HEAP();
+	}
+}
+
+void rebuild_size_classes() {
+	size_t hot_sizes[MAX_HOT_SIZES];
+	int num_hot = 0;
+	for (int i = 0; i < MAX_HOT_SIZES; i++) { /* Hottest sizes first */
+		size_t hottest = 0;
+		for (size_t bin = MIN_BLOCK_SIZE / 16; bin <= HISTOGRAM_MAX_SIZE / 16; bin++) {
+			if (size_histogram[bin] * HOT_SIZE_SHARE >= histogram_samples
+				&& (hottest == 0 || size_histogram[bin] > size_histogram[hottest / 16])
+				&& !size_in(bin * 16, hot_sizes, num_hot)) {
+				hottest = bin * 16;
+			}
+		}
+		if (hottest == 0) {
+			break;
+		}
+		hot_sizes[num_hot++] = hottest;
+	}
+	size_t limits[NUM_CLASS_LIMITS];
+	int num_limits = 0;
+	for (int i = 0; i < num_hot; i++) {
+		if (hot_sizes[i] - 16 >= MIN_BLOCK_SIZE && !size_in(hot_sizes[i] - 16, limits, num_limits)) {
+			limits[num_limits++] = hot_sizes[i] - 16;
+		}
+		if (!size_in(hot_sizes[i], limits, num_limits)) {
+			limits[num_limits++] = hot_sizes[i];
+		}
+	}
+	for (int i = 0; i < NUM_CLASS_LIMITS && num_limits < NUM_CLASS_LIMITS; i++) {
+		size_t limit = default_class_limits[default_limit_priority[i]];
+		if (!size_in(limit, limits, num_limits)) {
+			limits[num_limits++] = limit;
+		}
+	}
+	for (int i = 1; i < NUM_CLASS_LIMITS; i++) { /* Insertion sort */
+		size_t limit = limits[i];
+		int j = i;
+		while (j > 0 && limits[j - 1] > limit) {
+			limits[j] = limits[j - 1];
+			j--;
+		}
+		limits[j] = limit;
+	}
+	if (memcmp(limits, class_limits, sizeof(limits)) != 0) {
+		memcpy(class_limits, limits, sizeof(limits));
+		size_classes_adapted = memcmp(limits, default_class_limits, sizeof(limits)) != 0;
+		size_classes_stale = 1;
+		debug("size classes rebuilt: %zu %zu %zu %zu %zu %zu", limits[0], limits[1], limits[2],
+			limits[3], limits[4], limits[5]);
+	}
+}
+
+int size_in(size_t size, size_t *sizes, int count) {
+	for (int i = 0; i < count; i++) {
+		if (sizes[i] == size) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Moves every free block that is on the wrong list for the current size classes.
+ */
+void migrate_free_blocks() {
+	size_classes_stale = 0;
+	for (int i = 0; i < NUM_FREE_LISTS - 1; i++) { /* The wilderness list never changes */
+		sf_block *head = &sf_free_list_heads[i];
+		sf_block *block = head->body.links.next;
+		while (block != head) {
+			sf_block *next = block->body.links.next;
+			int size_class = get_size_class(block->header & ~(0xF));
+			if (size_class != i) {
+				remove_from_free_list(block);
+				insert_into_free_list(block, &sf_free_list_heads[size_class]);
+			}
+			block = next;
+		}
+	}
+}
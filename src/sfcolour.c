@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+size_t colour_min_size = 0;
+size_t colour_floor = SIZE_MAX;
+static unsigned int next_colour = 0;
+
+void sf_set_cache_colouring(size_t min_size) {
+	colour_min_size = min_size;
+	if (min_size != 0 && min_size < colour_floor) {
+		colour_floor = min_size;
+	}
+	next_colour = 0;
+}
+
+/*
+ * Allocates the block with room for the next colour's offset in front of the payload.
+ * The offset is stored with SF_COLOUR_MAGIC at the start of the payload and with
+ * SF_COLOUR_MARK right before the coloured pointer.
+ */
+void *colour_block(size_t size) {
+	size_t offset = (next_colour++ % SF_NUM_COLOURS) * SF_CACHE_LINE;
+	void *payload = malloc_block(size + offset);
+	if (payload == NULL || offset == 0) {
+		return payload;
+	}
+	*(uint64_t *) payload = offset | SF_COLOUR_MAGIC;
+	*(uint64_t *) (payload + offset - 8) = offset | SF_COLOUR_MARK;
+	return payload + offset;
+}
+
+/*
+ * The start of the payload a possibly coloured pointer points into.  The word before pp
+ * is only taken as an offset if it leads to an allocated block whose first word is the
+ * same offset with SF_COLOUR_MAGIC set.  Anything else, including pointers that are not
+ * heap pointers at all, is returned unchanged.
+ */
+void *colour_base(void *pp) {
+	if ((uintptr_t) pp % 16 != 0 || pp < sf_mem_start() + 8 + 32 + 8 || pp >= sf_mem_end()) {
+		return pp; /* (8 + 32 + 8) = padding + prologue + first header */
+	}
+	uint64_t word = *(uint64_t *) (pp - 8);
+	size_t offset = word & ~(0xF);
+	if ((word & 0xF) != SF_COLOUR_MARK || offset == 0 || offset >= SF_NUM_COLOURS * SF_CACHE_LINE
+		|| pp - offset < sf_mem_start() + 8 + 32 + 8) {
+		return pp;
+	}
+	void *base = pp - offset;
+	sf_header header = ((sf_block *) (base - 8))->header;
+	if (!(header & THIS_BLOCK_ALLOCATED) || (header & ~(0xF)) - 8 <= offset
+		|| *(uint64_t *) base != (offset | SF_COLOUR_MAGIC)) {
+		return pp;
+	}
+	return base;
+}
+
+/*
+ * Coloured blocks are resized by moving them, so the new pointer gets a colour of its
+ * own and the payload in front of the old one is never mistaken for data.
+ */
+void *sf_realloc_coloured(void *pp, void *base, size_t rsize) {
+	sf_block *block = base - 8;
+	size_t payload_size = (block->header & ~(0xF)) - 8 - (pp - base);
+	void *new_mem = sf_malloc(rsize);
+	if (new_mem == NULL) {
+		return NULL;
+	}
+	memcpy(new_mem, pp, payload_size < rsize ? payload_size : rsize);
+	trace_realloc_release();
+	sf_free(pp);
+	return new_mem;
+}
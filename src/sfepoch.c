@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifdef SF_THREADS
+#include <pthread.h>
+#endif
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Epoch-based reclamation.  A reader inside a traversal publishes the global epoch it
+ * entered in, and the global epoch only moves past e + 1 once no reader is left in
+ * epoch e.  A block retired while the global epoch was e can therefore be freed as soon
+ * as the global epoch reaches e + 2.  Each thread keeps its retired blocks in three
+ * buckets, one per epoch modulo 3, so a bucket is always safe to empty by the time its
+ * slot comes around again.
+ *
+ * In SF_THREADS builds a thread that exits gives its reader slot back, and hands the
+ * blocks it retired that are not safe to free yet over to the orphan buckets, which any
+ * thread's sf_epoch_reclaim empties once their epoch has passed.
+ */
+static unsigned long global_epoch = 0;
+static struct {
+	int in_use;
+	unsigned long state;      /* epoch << 1 | SF_EPOCH_ACTIVE, or 0 outside a traversal */
+} epoch_readers[SF_MAX_EPOCH_THREADS];
+static SF_THREAD_LOCAL int reader = -1; /* This thread's epoch_readers entry */
+static SF_THREAD_LOCAL int epoch_depth = 0;
+static SF_THREAD_LOCAL struct {
+	unsigned long epoch;
+	struct sf_epoch_batch *batches;
+} limbo[3];
+#ifdef SF_THREADS
+static struct {
+	unsigned long epoch;
+	struct sf_epoch_batch *batches;
+} orphans[3];                           /* Guarded by the heap lock */
+static pthread_key_t epoch_exit_key;
+static pthread_once_t epoch_exit_once = PTHREAD_ONCE_INIT;
+static SF_THREAD_LOCAL int exit_registered = 0;
+
+static void create_epoch_exit_key() {
+	pthread_key_create(&epoch_exit_key, epoch_thread_exit);
+}
+
+/* Makes sure epoch_thread_exit runs when the calling thread exits. */
+static void register_epoch_thread() {
+	if (!exit_registered) {
+		pthread_once(&epoch_exit_once, create_epoch_exit_key);
+		pthread_setspecific(epoch_exit_key, &exit_registered); /* Any value but NULL */
+		exit_registered = 1;
+	}
+}
+
+/*
+ * Destructor of epoch_exit_key.  Leaves any traversal the thread is still inside, frees
+ * what is already safe to free, moves the rest to the orphan buckets and gives the reader
+ * slot back.
+ */
+void epoch_thread_exit(void *unused) {
+	if (reader >= 0) {
+		epoch_depth = 0;
+		__atomic_store_n(&epoch_readers[reader].state, 0, __ATOMIC_SEQ_CST);
+	}
+	sf_epoch_reclaim();
+	LOCK_HEAP();
+	for (int i = 0; i < 3; i++) {
+		struct sf_epoch_batch *batch = limbo[i].batches;
+		if (batch == NULL) {
+			continue;
+		}
+		while (batch->next != NULL) {
+			batch = batch->next;
+		}
+		batch->next = orphans[i].batches;
+		if (orphans[i].batches == NULL || orphans[i].epoch < limbo[i].epoch) {
+			orphans[i].epoch = limbo[i].epoch; /* Same bucket, so the later epoch is safe for both */
+		}
+		orphans[i].batches = limbo[i].batches;
+		limbo[i].batches = NULL;
+	}
+	UNLOCK_HEAP();
+	if (reader >= 0) {
+		__atomic_store_n(&epoch_readers[reader].in_use, 0, __ATOMIC_SEQ_CST);
+		reader = -1;
+	}
+}
+#endif
+
+int sf_epoch_enter() {
+	if (epoch_depth++ > 0) { /* Nested traversal */
+		return 0;
+	}
+	for (int i = 0; reader < 0 && i < SF_MAX_EPOCH_THREADS; i++) {
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&epoch_readers[i].in_use, &unused, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			reader = i;
+		}
+	}
+	if (reader < 0) {
+		epoch_depth--;
+		sf_errno = ENOMEM;
+		return -1;
+	}
+#ifdef SF_THREADS
+	register_epoch_thread();
+#endif
+	unsigned long epoch;
+	do { /* The epoch must not move on between reading and publishing it */
+		epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&epoch_readers[reader].state, epoch << 1 | SF_EPOCH_ACTIVE, __ATOMIC_SEQ_CST);
+	} while (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) != epoch);
+	return 0;
+}
+
+void sf_epoch_exit() {
+	if (epoch_depth == 0) {
+		return;
+	}
+	if (--epoch_depth == 0) {
+		__atomic_store_n(&epoch_readers[reader].state, 0, __ATOMIC_RELEASE);
+	}
+}
+
+int sf_free_deferred(void *ptr) {
+	LOCK_HEAP();
+	int valid = valid_pointer(ptr);
+	UNLOCK_HEAP();
+	if (!valid) {
+		abort();
+	}
+	unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	int bucket = epoch % 3;
+	if (limbo[bucket].batches != NULL && limbo[bucket].epoch != epoch) {
+		free_retired_blocks(bucket); /* Retired three or more epochs ago */
+	}
+	struct sf_epoch_batch *batch = limbo[bucket].batches;
+	if (batch == NULL || batch->count == SF_EPOCH_BATCH_SIZE) {
+		batch = malloc_block(sizeof(struct sf_epoch_batch));
+		if (batch == NULL) {
+			sf_errno = ENOMEM;
+			return -1;
+		}
+		batch->next = limbo[bucket].batches;
+		batch->count = 0;
+		limbo[bucket].batches = batch;
+#ifdef SF_THREADS
+		register_epoch_thread();
+#endif
+	}
+	limbo[bucket].epoch = epoch;
+	batch->blocks[batch->count++] = ptr;
+	if (batch->count == SF_EPOCH_BATCH_SIZE) {
+		sf_epoch_reclaim();
+	}
+	return 0;
+}
+
+void sf_epoch_reclaim() {
+	for (int i = 0; i < 2 && try_advance_epoch(); i++) {
+		continue; /* Two epochs is enough to free everything no reader holds */
+	}
+	unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < 3; i++) {
+		if (limbo[i].batches != NULL && epoch >= limbo[i].epoch + 2) {
+			free_retired_blocks(i);
+		}
+	}
+#ifdef SF_THREADS
+	LOCK_HEAP();
+	for (int i = 0; i < 3; i++) {
+		if (orphans[i].batches != NULL && epoch >= orphans[i].epoch + 2) {
+			free_batches(orphans[i].batches);
+			orphans[i].batches = NULL;
+		}
+	}
+	UNLOCK_HEAP();
+#endif
+}
+
+/*
+ * Moves the global epoch on by one if every reader inside a traversal entered in the
+ * current epoch.  Returns 0 if a reader is still in an older epoch.
+ */
+int try_advance_epoch() {
+	unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < SF_MAX_EPOCH_THREADS; i++) {
+		if (!__atomic_load_n(&epoch_readers[i].in_use, __ATOMIC_SEQ_CST)) {
+			continue;
+		}
+		unsigned long state = __atomic_load_n(&epoch_readers[i].state, __ATOMIC_SEQ_CST);
+		if ((state & SF_EPOCH_ACTIVE) && (state >> 1) != epoch) {
+			return 0;
+		}
+	}
+	__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return 1; /* Moved on, by this thread or another */
+}
+
+void free_retired_blocks(int bucket) {
+	free_batches(limbo[bucket].batches);
+	limbo[bucket].batches = NULL;
+}
+
+void free_batches(struct sf_epoch_batch *batch) {
+	while (batch != NULL) {
+		struct sf_epoch_batch *next = batch->next;
+		for (int i = 0; i < batch->count; i++) {
+			sf_free(batch->blocks[i]);
+		}
+		sf_free(batch);
+		batch = next;
+	}
+}
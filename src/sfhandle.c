@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Handles are entries of a fixed table.  sf_compact walks the heap in address order
+ * next to the unlocked handles sorted by address, so the blocks themselves carry no
+ * extra bookkeeping.
+ */
+static struct sf_handle_entry handles[SF_MAX_HANDLES];
+
+sf_handle sf_halloc(size_t size) {
+	void *payload = sf_malloc(size);
+	if (payload == NULL) {
+		return NULL;
+	}
+	LOCK_HEAP();
+	for (int i = 0; i < SF_MAX_HANDLES; i++) {
+		if (handles[i].payload == NULL) {
+			handles[i].payload = payload;
+			handles[i].locks = 0;
+			UNLOCK_HEAP();
+			return &handles[i];
+		}
+	}
+	UNLOCK_HEAP();
+	sf_free(payload);
+	sf_errno = ENOMEM;
+	return NULL;
+}
+
+void *sf_hlock(sf_handle handle) {
+	LOCK_HEAP(); /* sf_compact moves blocks under the heap lock */
+	if (!valid_handle(handle)) {
+		UNLOCK_HEAP();
+		sf_errno = EINVAL;
+		return NULL;
+	}
+	handle->locks++;
+	void *payload = handle->payload;
+	UNLOCK_HEAP();
+	return payload;
+}
+
+void sf_hunlock(sf_handle handle) {
+	LOCK_HEAP();
+	if (!valid_handle(handle) || handle->locks == 0) {
+		abort();
+	}
+	handle->locks--;
+	UNLOCK_HEAP();
+}
+
+void sf_hfree(sf_handle handle) {
+	LOCK_HEAP();
+	if (!valid_handle(handle)) {
+		abort();
+	}
+	void *payload = handle->payload;
+	handle->payload = NULL;
+	UNLOCK_HEAP();
+	sf_free(payload);
+}
+
+int valid_handle(sf_handle handle) {
+	return handle >= handles && handle < handles + SF_MAX_HANDLES && handle->payload != NULL;
+}
+
+static int compare_handles(const void *a, const void *b) {
+	void *payload_a = colour_base((*(sf_handle *) a)->payload);
+	void *payload_b = colour_base((*(sf_handle *) b)->payload);
+	return payload_a < payload_b ? -1 : payload_a > payload_b;
+}
+
+size_t sf_compact() {
+	sf_handle movable[SF_MAX_HANDLES];
+	int num_movable = 0;
+	LOCK_HEAP();
+	if (sf_mem_start() == sf_mem_end()) {
+		UNLOCK_HEAP();
+		return 0;
+	}
+	for (int i = 0; i < SF_MAX_HANDLES; i++) {
+		if (handles[i].payload != NULL && handles[i].locks == 0) {
+			movable[num_movable++] = &handles[i];
+		}
+	}
+	qsort(movable, num_movable, sizeof(movable[0]), compare_handles);
+	sf_block *epilogue = sf_mem_end() - 8;
+	sf_block *block = sf_mem_start() + 8 + 32; /* (8 + 32) = padding bytes + prologue bytes */
+	int next = 0;
+	int moved = 0;
+	while (block < epilogue) {
+		size_t block_size = block->header & ~(0xF);
+		sf_block *next_block = ((void *) block) + block_size;
+		if (!(block->header & THIS_BLOCK_ALLOCATED) && next_block < epilogue) {
+			while (next < num_movable && colour_base(movable[next]->payload) < (void *) next_block + 8) {
+				next++; /* Handle blocks before this free block stay put */
+			}
+			if (next < num_movable && colour_base(movable[next]->payload) == (void *) next_block + 8) {
+				size_t colour_offset = movable[next]->payload - ((void *) next_block + 8);
+				sf_block *free_block = block;
+				block = slide_block(free_block, next_block);
+				movable[next++]->payload = (void *) free_block + 8 + colour_offset;
+				moved = 1;
+				continue; /* The free block moved up, so look at what follows it now */
+			}
+		}
+		block = next_block;
+	}
+	if (moved) {
+		forget_placement_hints(); /* They may point into the middle of a moved block */
+	}
+	size_t free_tail = 0;
+	sf_block *wilderness = sf_free_list_heads[7].body.links.next;
+	if (wilderness != &sf_free_list_heads[7]) {
+		free_tail = wilderness->header & ~(0xF);
+	}
+	UNLOCK_HEAP();
+	return free_tail;
+}
+
+/*
+ * Moves an allocated block down into the free block right before it.  The free space
+ * ends up after the block and is coalesced with whatever follows.  Returns the
+ * resulting free block.
+ */
+sf_block *slide_block(sf_block *free_block, sf_block *block) {
+	size_t free_size = free_block->header & ~(0xF);
+	size_t block_size = block->header & ~(0xF);
+	int prev_allocated = (free_block->header & PREV_BLOCK_ALLOCATED) >> 1;
+	if (free_size >= MIN_FREE_BLOCK_SIZE) { /* Smaller free blocks are never listed */
+		remove_from_free_list(free_block);
+	}
+	memmove(free_block, block, block_size);
+	free_block->header = create_header(block_size, prev_allocated, 1);
+	sf_block *new_free_block = ((void *) free_block) + block_size;
+	new_free_block->header = create_header(free_size, 1, 0);
+	return coalesce(new_free_block);
+}
@@ -0,0 +1,113 @@
+#define _DEFAULT_SOURCE /* madvise, MADV_HUGEPAGE */
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Huge page segments.  The heap only ever grows at its end, so the segments advised so
+ * far are always the ones below advised_end.
+ */
+int huge_pages_enabled = 0;
+static void *advised_end = NULL;
+static size_t advised_bytes = 0;
+
+static void *segment_align_up(void *addr) {
+	return (void *) (((uintptr_t) addr + SF_SEGMENT_SIZE - 1) & ~(SF_SEGMENT_SIZE - 1));
+}
+
+static void *segment_align_down(void *addr) {
+	return (void *) ((uintptr_t) addr & ~(SF_SEGMENT_SIZE - 1));
+}
+
+void sf_set_huge_pages(int enabled) {
+	huge_pages_enabled = enabled;
+	if (enabled) {
+		advise_huge_pages(); /* Segments the heap already spans */
+	}
+}
+
+/*
+ * Where the heap should end once it has grown by size bytes: the next segment boundary,
+ * or just the end of the heap with huge pages off.
+ */
+void *segment_end_for(size_t size) {
+	if (!huge_pages_enabled) {
+		return sf_mem_end();
+	}
+	return segment_align_up(sf_mem_end() + size);
+}
+
+/* Returns 1 if the heap should grow by another page to reach segment_end. */
+int grow_for_segment(void *segment_end) {
+	return sf_mem_end() < segment_end && !exceeds_soft_limit(PAGE_SZ) && !exceeds_hard_limit(PAGE_SZ);
+}
+
+/* Advises the whole segments the heap has grown over since the last call. */
+void advise_huge_pages() {
+	if (!huge_pages_enabled || sf_mem_start() == sf_mem_end()) {
+		return;
+	}
+	void *from = segment_align_up(sf_mem_start());
+	if (advised_end > from) {
+		from = advised_end;
+	}
+	void *to = segment_align_down(sf_mem_end());
+	if (to <= from) {
+		return;
+	}
+	if (madvise(from, to - from, MADV_HUGEPAGE) == 0) {
+		advised_bytes += to - from;
+	}
+	advised_end = to; /* Not retried if the kernel has no transparent huge pages */
+}
+
+int sf_huge_page_stats(struct sf_huge_page_stats *stats) {
+	if (stats == NULL) {
+		sf_errno = EINVAL;
+		return -1;
+	}
+	LOCK_HEAP();
+	stats->heap_size = sf_mem_end() - sf_mem_start();
+	stats->segment_bytes = advised_bytes;
+	stats->mapping_size = 0;
+	stats->mapping_huge_page_bytes = 0;
+	if (stats->heap_size > 0) {
+		read_mapping_stats(sf_mem_start(), stats);
+	}
+	UNLOCK_HEAP();
+	return 0;
+}
+
+/*
+ * Fills in the size and AnonHugePages of the mapping containing addr, from
+ * /proc/self/smaps.  Both stay 0 if the file or the mapping cannot be found.
+ */
+void read_mapping_stats(void *addr, struct sf_huge_page_stats *stats) {
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	if (smaps == NULL) {
+		return;
+	}
+	char line[256];
+	int in_mapping = 0;
+	size_t kb;
+	while (fgets(line, sizeof(line), smaps) != NULL) {
+		unsigned long start, end;
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (in_mapping) {
+				break; /* Past the mapping without an AnonHugePages line */
+			}
+			in_mapping = (uintptr_t) addr >= start && (uintptr_t) addr < end;
+			if (in_mapping) {
+				stats->mapping_size = end - start;
+			}
+		} else if (in_mapping && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+			stats->mapping_huge_page_bytes = kb * 1024;
+			break;
+		}
+	}
+	fclose(smaps);
+}
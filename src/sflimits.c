@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <errno.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Memory limits.  Before the heap grows past the soft limit, the registered pressure
+ * callbacks are asked to free memory and the free lists are searched again.  The heap
+ * never grows past the hard limit.  A limit of 0 means no limit.
+ */
+static size_t soft_limit = 0;
+static size_t hard_limit = 0;
+static struct {
+	sf_pressure_callback callback;
+	void *arg;
+} pressure_callbacks[SF_MAX_PRESSURE_CALLBACKS];
+static int num_pressure_callbacks = 0;
+static int relieving_pressure = 0; /* Callbacks that allocate must not recurse */
+
+int sf_set_memory_limit(size_t soft, size_t hard) {
+	if (hard != 0 && soft > hard) {
+		sf_errno = EINVAL;
+		return -1;
+	}
+	soft_limit = soft;
+	hard_limit = hard;
+	return 0;
+}
+
+int sf_register_pressure_callback(sf_pressure_callback callback, void *arg) {
+	if (callback == NULL) {
+		sf_errno = EINVAL;
+		return -1;
+	}
+	if (num_pressure_callbacks == SF_MAX_PRESSURE_CALLBACKS) {
+		sf_errno = ENOMEM;
+		return -1;
+	}
+	pressure_callbacks[num_pressure_callbacks].callback = callback;
+	pressure_callbacks[num_pressure_callbacks].arg = arg;
+	num_pressure_callbacks++;
+	return 0;
+}
+
+/*
+ * The number of bytes sf_mem_grow has to add for a block of the given size, counting the
+ * wilderness block the new pages coalesce with.
+ */
+size_t heap_growth_needed(size_t size) {
+	size_t available = 0;
+	sf_block *wilderness = sf_free_list_heads[7].body.links.next;
+	if (wilderness != &sf_free_list_heads[7]) {
+		available = wilderness->header & ~(0xF);
+	}
+	if (available >= size) {
+		return 0;
+	}
+	size_t pages = (size - available + PAGE_SZ - 1) / PAGE_SZ;
+	return pages * PAGE_SZ;
+}
+
+int exceeds_soft_limit(size_t growth) {
+	return soft_limit != 0 && (size_t) (sf_mem_end() - sf_mem_start()) + growth > soft_limit;
+}
+
+int exceeds_hard_limit(size_t growth) {
+	return hard_limit != 0 && (size_t) (sf_mem_end() - sf_mem_start()) + growth > hard_limit;
+}
+
+/*
+ * Runs the pressure callbacks.  Returns 1 if any ran, 0 if there were none or they are
+ * already running.
+ */
+int relieve_memory_pressure(size_t size, size_t growth) {
+	if (num_pressure_callbacks == 0 || relieving_pressure) {
+		return 0;
+	}
+	struct sf_pressure_info info;
+	info.heap_size = sf_mem_end() - sf_mem_start();
+	info.soft_limit = soft_limit;
+	info.hard_limit = hard_limit;
+	info.requested = size;
+	info.trim_hint = info.heap_size + growth - soft_limit;
+	int suppressed = trace_suppressed;
+	trace_suppressed = 0; /* Callbacks call the allocator themselves, so trace them */
+	relieving_pressure = 1;
+	for (int i = 0; i < num_pressure_callbacks; i++) {
+		pressure_callbacks[i].callback(&info, pressure_callbacks[i].arg);
+	}
+	relieving_pressure = 0;
+	trace_suppressed = suppressed;
+	return 1;
+}
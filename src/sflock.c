@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+#ifdef SF_THREADS
+#include <pthread.h>
+
+/*
+ * Locks for SF_THREADS builds (see my_sfmm.h for what each covers and the locking
+ * order).  Each counts how many times the calling thread holds it, so sf_realloc,
+ * sf_memalign, pressure callbacks and whole-heap operations can call back into the
+ * allocator.
+ */
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t boundary_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t list_locks[NUM_FREE_LISTS] = { /* One per sf_free_list_heads entry */
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+static SF_THREAD_LOCAL int grow_depth = 0;
+static SF_THREAD_LOCAL int boundary_depth = 0;
+static SF_THREAD_LOCAL int list_depth[NUM_FREE_LISTS];
+
+void lock_grow() {
+	if (grow_depth++ == 0) {
+		pthread_mutex_lock(&grow_lock);
+	}
+}
+
+void unlock_grow() {
+	if (--grow_depth == 0) {
+		pthread_mutex_unlock(&grow_lock);
+	}
+}
+
+void lock_boundary() {
+	if (boundary_depth++ == 0) {
+		pthread_mutex_lock(&boundary_lock);
+	}
+}
+
+void unlock_boundary() {
+	if (--boundary_depth == 0) {
+		pthread_mutex_unlock(&boundary_lock);
+	}
+}
+
+void lock_list(int list) {
+	if (list_depth[list]++ == 0) {
+		pthread_mutex_lock(&list_locks[list]);
+	}
+}
+
+void unlock_list(int list) {
+	if (--list_depth[list] == 0) {
+		pthread_mutex_unlock(&list_locks[list]);
+	}
+}
+
+void lock_heap() {
+	lock_grow();
+	lock_boundary();
+	for (int i = NUM_FREE_LISTS - 1; i >= 0; i--) {
+		lock_list(i);
+	}
+}
+
+void unlock_heap() {
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		unlock_list(i);
+	}
+	unlock_boundary();
+	unlock_grow();
+}
+#endif
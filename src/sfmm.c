@@ -11,21 +11,129 @@
 #include "my_sfmm.h"
 
 void *sf_malloc(size_t size) {
+	if (TRACING()) {
+		return sf_trace_malloc(size);
+	}
 	if (size == 0) {
 		return NULL;
 	}
-	else if (sf_mem_start() == sf_mem_end()) { /* First time sf_malloc being called */
-		initialize_free_lists();
-		initialize_heap();
+	if (colour_min_size != 0 && size >= colour_min_size) {
+		return colour_block(size);
+	}
+	return malloc_block(size);
+}
+
+/*
+ * sf_malloc without tracing or colouring.
+ */
+void *malloc_block(size_t size) {
+	if (sf_mem_start() == sf_mem_end()) { /* First time sf_malloc being called */
+		initialize_allocator();
 	}
 	size_t block_size = calculate_aligned_block_size(size);
-	sf_block *free_block = find_free_block(block_size);
+	sf_block *block = claim_free_block(block_size, get_size_class(block_size));
+	if (block == NULL) {
+		return NULL;
+	}
+	record_block_size(block_size);
+    return ((void *) block + 8);
+}
+
+/*
+ * Entry point for the constant-size sf_malloc in sfmm_inline.h, which has already worked
+ * out the block size and size class at compile time.  The size class assumes the default
+ * class limits, so once they have been adapted every call takes the sf_malloc path.
+ * Otherwise the block comes straight off the head of its class list when it fits there.
+ */
+void *sf_malloc_class(size_t size, size_t block_size, int size_class) {
+	if (size_classes_adapted || TRACING() || (colour_min_size != 0 && size >= colour_min_size)) {
+		return sf_malloc(size);
+	}
+	LOCK_LIST(size_class);
+	sf_block *free_block = pop_size_class(block_size, size_class);
+	if (free_block != NULL) {
+		carve_block(free_block, block_size);
+	}
+	UNLOCK_LIST(size_class);
 	if (free_block == NULL) {
-		free_block = expand_heap_to_fit(block_size);
-		if (free_block == NULL) {
-			return NULL;
+		return malloc_block(size);
+	}
+	record_block_size(block_size);
+	return ((void *) free_block + 8);
+}
+
+/*
+ * Unlinks the first block of a size class list if it is at least size bytes.  Returns
+ * NULL if it is smaller, the list is empty, the heap is not set up yet or the lists are
+ * waiting to be migrated to new size classes.
+ */
+sf_block *pop_size_class(size_t size, int size_class) {
+	sf_block *head = &sf_free_list_heads[size_class];
+	sf_block *block = head->body.links.next;
+	if (block == NULL || block == head || size_classes_stale || (block->header & ~(0xF)) < size) {
+		return NULL;
+	}
+	sf_block *next = block->body.links.next;
+	head->body.links.next = next;
+	next->body.links.prev = head;
+	return block;
+}
+
+/*
+ * Allocates a block of the given size out of the first free block that fits, growing
+ * the heap if none does.  Returns NULL if the heap cannot grow.
+ */
+sf_block *claim_free_block(size_t size, int size_class) {
+	sf_block *block = take_free_block(size, size_class);
+	if (block != NULL) {
+		return block;
+	}
+	LOCK_GROW();
+	block = take_free_block(size, size_class); /* Another thread may have grown the heap */
+	while (block == NULL && expand_heap_to_fit(size) != NULL) {
+		block = take_free_block(size, size_class); /* Retried if another thread got it first */
+	}
+	UNLOCK_GROW();
+	return block;
+}
+
+/*
+ * Finds the first free block that fits and allocates it before its list's lock is
+ * dropped, so no other thread can allocate or coalesce it in between.
+ */
+sf_block *take_free_block(size_t size, int size_class) {
+	for (int i = size_class; i < NUM_FREE_LISTS; i++) {
+		LOCK_LIST(i);
+		sf_block *block = fit_in_list(i, size, size_class);
+		if (block != NULL) {
+			place_block(block, size);
+		}
+		UNLOCK_LIST(i);
+		if (block != NULL) {
+			return block;
 		}
 	}
+	return NULL;
+}
+
+sf_block *place_block(sf_block *free_block, size_t block_size) {
+	size_t free_block_size = free_block->header & ~(0xF);
+	size_t split_size = free_block_size - block_size;
+	if (split_size >= 32 && free_block == sf_free_list_heads[7].body.links.next) {
+		allocate_from_wilderness(free_block, block_size);
+		return free_block;
+	}
+	remove_from_free_list(free_block); /* Before a small block's split header overwrites its links */
+	carve_block(free_block, block_size);
+	return free_block;
+}
+
+/*
+ * Allocates the first block_size bytes of a free block that is on no list, and puts the
+ * rest on a list when it is big enough to split off.  The block's list lock is held, and
+ * the rest's list is never a higher one.
+ */
+void carve_block(sf_block *free_block, size_t block_size) {
 	size_t free_block_size = free_block->header & ~(0xF);
 	size_t split_size = free_block_size - block_size;
 	if (split_size >= 32) {
@@ -35,18 +143,172 @@ void *sf_malloc(size_t size) {
 		block_size = free_block_size;
 	}
 	allocate_block(free_block, block_size);
-    return ((void *) free_block + 8);
 }
 
 
 
 
+/*
+ * Lifetime hints.  Short-lived blocks are carved from the high end of the chosen free
+ * block and everything else from the low end, so freed short-lived blocks coalesce with
+ * each other instead of leaving holes between long-lived ones.  Long-lived blocks go to
+ * the lowest-addressed fit, and hot blocks are packed right after the previous hot block
+ * when the space there is free.
+ */
+static sf_block *hot_block = NULL; /* Most recent SF_HINT_HOT block */
+static size_t hot_block_size = 0;
+static sf_block *long_cursor = NULL; /* No listed free block below it, NULL for the first block */
+
+/* Blocks go onto different lists at the same time, so the cursor is only ever lowered. */
+static void lower_long_cursor(sf_block *block) {
+#ifdef SF_THREADS
+	sf_block *cursor = __atomic_load_n(&long_cursor, __ATOMIC_RELAXED);
+	while (block < cursor && !__atomic_compare_exchange_n(&long_cursor, &cursor, block, 0,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+#else
+	if (block < long_cursor) {
+		long_cursor = block;
+	}
+#endif
+}
+
+void *sf_malloc_hint(size_t size, int hints) {
+	if (TRACING()) {
+		return sf_trace_malloc_hint(size, hints);
+	}
+	if (size == 0) {
+		return NULL;
+	}
+	else if (sf_mem_start() == sf_mem_end()) { /* First time sf_malloc being called */
+		initialize_allocator();
+	}
+	size_t block_size = calculate_aligned_block_size(size);
+	sf_block *free_block = NULL;
+	LOCK_HEAP(); /* Hints look at blocks on any list and at their neighbours */
+	record_block_size(block_size);
+	if (hints & SF_HINT_HOT) {
+		free_block = find_hot_block(block_size);
+	}
+	if (free_block == NULL && (hints & SF_HINT_LONG)) {
+		free_block = find_lowest_free_block(block_size);
+	}
+	if (free_block == NULL) {
+		free_block = find_free_block(block_size);
+	}
+	if (free_block == NULL) {
+		free_block = expand_heap_to_fit(block_size);
+		if (free_block == NULL) {
+			UNLOCK_HEAP();
+			return NULL;
+		}
+	}
+	sf_block *block;
+	if (hints & SF_HINT_SHORT) {
+		block = place_block_at_tail(free_block, block_size);
+	} else {
+		block = place_block(free_block, block_size);
+	}
+	if (hints & SF_HINT_HOT) {
+		hot_block = block;
+		hot_block_size = block->header & ~(0xF);
+	}
+	UNLOCK_HEAP();
+	return ((void *) block + 8);
+}
+
+sf_block *find_hot_block(size_t size) {
+	if (hot_block == NULL || !(hot_block->header & THIS_BLOCK_ALLOCATED)
+		|| (hot_block->header & ~(0xF)) != hot_block_size) { /* Resized since it was placed */
+		return NULL;
+	}
+	sf_block *next_block = ((void *) hot_block) + hot_block_size;
+	if ((void *) next_block >= sf_mem_end() - 8 || (next_block->header & THIS_BLOCK_ALLOCATED)
+		|| (next_block->header & ~(0xF)) < MIN_FREE_BLOCK_SIZE) {
+		return NULL;
+	}
+	if (!check_enough_space(*next_block, size)) {
+		return NULL;
+	}
+	return next_block;
+}
+
+/*
+ * Walks the heap in address order from long_cursor and stops at the first listed free
+ * block that fits.  The cursor moves up to the first listed block the walk meets, so
+ * the packed long-lived blocks at the bottom of the heap are only walked over once.
+ */
+sf_block *find_lowest_free_block(size_t size) {
+	sf_block *epilogue = sf_mem_end() - 8;
+	sf_block *block = long_cursor != NULL ? long_cursor : sf_mem_start() + 8 + 32;
+	int below_listed = 1; /* Nothing listed between the cursor and block */
+	for (; block < epilogue; block = (void *) block + (block->header & ~(0xF))) {
+		if ((block->header & THIS_BLOCK_ALLOCATED) || (block->header & ~(0xF)) < MIN_FREE_BLOCK_SIZE) {
+			continue;
+		}
+		if (below_listed) {
+			long_cursor = block;
+			below_listed = 0;
+		}
+		if (check_enough_space(*block, size)) {
+			return block;
+		}
+	}
+	if (below_listed) {
+		long_cursor = epilogue; /* The next listed block starts here or lower */
+	}
+	return NULL;
+}
+
+/* Placement state points into the heap, so it goes when the heap is rebuilt. */
+void forget_placement_hints() {
+	hot_block = NULL;
+	long_cursor = NULL;
+}
+
+sf_block *place_block_at_tail(sf_block *free_block, size_t block_size) {
+	size_t free_block_size = free_block->header & ~(0xF);
+	size_t split_size = free_block_size - block_size;
+	if (split_size < 32) {
+		return place_block(free_block, block_size);
+	}
+	int prev_allocated = (free_block->header & PREV_BLOCK_ALLOCATED) >> 1;
+	remove_from_free_list(free_block);
+	create_free_block(split_size, prev_allocated, free_block);
+	sf_block *block = ((void *) free_block) + split_size;
+	block->header = create_header(block_size, 0, 1);
+	set_prev_allocation_flag(((void *) block) + block_size, 1);
+	return block;
+}
+
+
+
+
+void initialize_allocator() {
+	LOCK_HEAP();
+	if (sf_mem_start() == sf_mem_end()) { /* Another thread may have got here first */
+		initialize_free_lists();
+		initialize_heap();
+	}
+	UNLOCK_HEAP();
+}
+
 void initialize_heap() {
 	sf_mem_grow();
+	format_heap();
+}
+
+/*
+ * Lays the heap out as prologue, one free block and epilogue over however many pages it
+ * already spans, throwing away whatever it held.
+ */
+void format_heap() {
+	forget_placement_hints();
+	initialize_free_lists();
 	allocate_prologue();
 	allocate_epilogue();
 	int allocated_bytes = 8 + 32 + 8; /* padding + prologue + epilogue */
-	size_t free_block_size = PAGE_SZ - allocated_bytes;
+	size_t free_block_size = (sf_mem_end() - sf_mem_start()) - allocated_bytes;
 	sf_block *free_block_address = sf_mem_start() + 8 + 32; /* (8 + 32) = padding bytes + prologue bytes */
 	create_free_block(free_block_size, 1, free_block_address);
 }
@@ -65,27 +327,29 @@ void allocate_epilogue() {
 
 void create_free_block(size_t block_size, int prv_alloc, sf_block *block_address) {
 	sf_header header = create_header(block_size, prv_alloc, 0);
+	int list = free_list_of(block_size, block_address);
+	LOCK_LIST(list);
 	block_address->header = header;
-	sf_block *list_head = get_relevant_free_list_head(block_size, block_address);
-	insert_into_free_list(block_address, list_head);
+	insert_into_free_list(block_address, &sf_free_list_heads[list]);
 	sf_footer *footer = ((void *) block_address) + block_size - 8;
 	*footer = header;
+	UNLOCK_LIST(list);
 }
 
 sf_block *get_relevant_free_list_head(size_t size, void *block) {
-	if (block + size == sf_mem_end() - 8) { /* If block is wilderness block */
-		return &sf_free_list_heads[7];
-	}
-	int min_block_size = 32;
-	if (size > (32 * min_block_size)) {
-		return &sf_free_list_heads[6];
-	}
-	for (int i = 0; i < NUM_FREE_LISTS - 1; i++) {
-		if (power(2, i-1) * min_block_size < size && size <= power(2, i) * min_block_size) {
-			return &sf_free_list_heads[i];
-		}
+	return &sf_free_list_heads[free_list_of(size, block)];
+}
+
+/*
+ * The list a free block of the given size belongs on.  While the heap grows, the
+ * wilderness is briefly not at the end of the heap, but it is still the block on the
+ * wilderness list.
+ */
+int free_list_of(size_t size, void *block) {
+	if (block + size == sf_mem_end() - 8 || block == sf_free_list_heads[7].body.links.next) {
+		return 7;
 	}
-	return NULL;
+	return get_size_class(size);
 }
 
 void insert_into_free_list(sf_block *block, sf_block *list_head) {
@@ -94,6 +358,8 @@ void insert_into_free_list(sf_block *block, sf_block *list_head) {
 	block->body.links.next = next;
 	list_head->body.links.next = block;
 	next->body.links.prev = block;
+	stamp_free_block(block);
+	lower_long_cursor(block);
 }
 
 sf_header create_header(size_t block_size, int prv_alloc, int alloc) {
@@ -123,8 +389,8 @@ void initialize_free_lists() {
 
 size_t calculate_aligned_block_size(size_t size) {
 	size_t block_size = size + 8; /* 8 bytes for header */
-	if (block_size < 32) { /* Must be at least 32 bytes */
-		block_size = 32;
+	if (block_size < MIN_BLOCK_SIZE) { /* Must be at least MIN_BLOCK_SIZE bytes */
+		block_size = MIN_BLOCK_SIZE;
 	}
 	if (block_size % 16 != 0) {
 		block_size += 16 - (block_size % 16); /* Add padding */
@@ -136,9 +402,18 @@ size_t calculate_aligned_block_size(size_t size) {
 
 
 sf_block *find_free_block(size_t size) {
-	sf_block *block;
-	for (int i = 0; i < NUM_FREE_LISTS; i++) {
-		block = search_free_list(&sf_free_list_heads[i], size);
+	return find_free_block_from(size, get_size_class(size));
+}
+
+/*
+ * Without the heap lock the block found may be taken by another thread before it is
+ * used; claim_free_block allocates it under its list's lock instead.
+ */
+sf_block *find_free_block_from(size_t size, int size_class) {
+	for (int i = size_class; i < NUM_FREE_LISTS; i++) {
+		LOCK_LIST(i);
+		sf_block *block = fit_in_list(i, size, size_class);
+		UNLOCK_LIST(i);
 		if (block != NULL) {
 			return block;
 		}
@@ -146,6 +421,25 @@ sf_block *find_free_block(size_t size) {
 	return NULL;
 }
 
+/*
+ * Lists below the size class only hold smaller blocks, and every block in a list above it
+ * is big enough, so only the size class's own list needs a first-fit search.  Called with
+ * the list's lock held, which SF_THREADS builds never hold while the lists are stale.
+ */
+sf_block *fit_in_list(int list, size_t size, int size_class) {
+	if (size_classes_stale) {
+		migrate_free_blocks();
+	}
+	if (list == size_class) {
+		return search_free_list(&sf_free_list_heads[list], size);
+	}
+	sf_block *block = sf_free_list_heads[list].body.links.next;
+	if (block != &sf_free_list_heads[list] && check_enough_space(*block, size)) {
+		return block;
+	}
+	return NULL;
+}
+
 sf_block *search_free_list(sf_block *head, size_t size) {
 	if ((head->body.links.next == 0 && head->body.links.prev == 0) || (head->body.links.next == head && head->body.links.prev == head)) {
 		return NULL;
@@ -170,8 +464,22 @@ int check_enough_space(sf_block block, size_t required_size) {
 
 
 sf_block *expand_heap_to_fit(size_t size) {
+	size_t growth = heap_growth_needed(size);
+	if (exceeds_soft_limit(growth) && relieve_memory_pressure(size, growth)) {
+		sf_block *free_block = find_free_block(size); /* The callbacks may have made room */
+		if (free_block != NULL) {
+			return free_block;
+		}
+		growth = heap_growth_needed(size);
+	}
+	if (exceeds_hard_limit(growth)) {
+		sf_errno = ENOMEM;
+		return NULL;
+	}
 	size_t new_size = 0;
 	void *new_page_start;
+	LOCK_BOUNDARY();
+	LOCK_LIST(7);
 	sf_block *block_start = sf_mem_end() - 8;
 	sf_block *wilderness_list_head = &sf_free_list_heads[7];
 	int prev_allocated;
@@ -179,12 +487,20 @@ sf_block *expand_heap_to_fit(size_t size) {
 		prev_allocated = 1;
 	} else {
 		prev_allocated = 0;
+		write_wilderness_footer(); /* Coalescing with the new page reads it */
 	}
 	sf_header header;
-	while (new_size < size) {
+	void *segment_end = segment_end_for(size);
+	int saved_errno = sf_errno;
+	while (new_size < size || grow_for_segment(segment_end)) {
 		new_page_start = sf_mem_grow();
 		if (new_page_start == NULL) {
-			return NULL;
+			if (new_size >= size) { /* The rest of the segment did not fit, which is fine */
+				sf_errno = saved_errno;
+				break;
+			}
+			block_start = NULL;
+			break;
 		}
 		new_page_start -= 8; /* Account for 8 bytes of previous epilogue */
 		header = create_header(PAGE_SZ, prev_allocated, 0);
@@ -193,40 +509,117 @@ sf_block *expand_heap_to_fit(size_t size) {
 		new_size = (block_start->header) & ~(0xF);
 		prev_allocated = 0;
 	}
+	UNLOCK_LIST(7);
+	UNLOCK_BOUNDARY();
+	if (block_start != NULL) {
+		advise_huge_pages();
+	}
 	return block_start;
 }
 
+/*
+ * Merges a block being freed with the free blocks on either side and puts the result on
+ * its list.  The block's header is left alone until unlink_free_prev has settled whether
+ * the block before it is free, since in SF_THREADS builds allocating that block sets
+ * this header's prev-allocated bit.  Called with the boundary lock held.
+ */
 sf_block *coalesce(sf_block *block) {
-	sf_header header = block->header;
-	int prev_allocated = (header & 0x2) >> 1;
-	size_t block_size = header & ~(0xF);
+	size_t block_size = block->header & ~(0xF);
 	sf_block *block_start = block;
-	sf_block *next_block = ((void *) block) + block_size;
-	if (!prev_allocated) {
-		sf_footer *prev_footer = ((void *) block) - 8;
-		size_t prev_size = *prev_footer & ~(0xF);
-		remove_from_free_list((void *) block - prev_size);
-		block_size += prev_size;
-		block_start = ((void *) block_start) - prev_size;
-		prev_allocated = (*prev_footer & 0x2) >> 1;
-	}
-	sf_header next_header = next_block->header;
-	int next_allocated = next_header & 0x1;
-	if ((void *) next_block < (sf_mem_end() - 8) && !next_allocated) {
-		remove_from_free_list(next_block);
-		size_t next_size = next_header & ~(0xF);
-		block_size += next_size;
-		next_block = ((void *) next_block) + next_size;
-	}
+	int prev_allocated = 1;
+	sf_block *prev_block = unlink_free_prev(block);
+	if (prev_block != NULL) {
+		block_size += prev_block->header & ~(0xF);
+		block_start = prev_block;
+		prev_allocated = (prev_block->header & PREV_BLOCK_ALLOCATED) >> 1;
+	}
+	block->header &= ~(THIS_BLOCK_ALLOCATED); /* Freeing it again fails valid_pointer even once merged */
+	sf_block *next_block = unlink_free_next(((void *) block) + (block->header & ~(0xF)));
+	if (next_block != NULL) {
+		block_size += next_block->header & ~(0xF);
+	}
+	next_block = ((void *) block_start) + block_size;
 	sf_footer *block_footer = ((void *) next_block) - 8;
 	sf_header new_header = create_header(block_size, prev_allocated, 0);
-	(block_start->header) = new_header;
+	int listed = block_size >= MIN_FREE_BLOCK_SIZE; /* Smaller blocks have no room for links */
+	int list = free_list_of(block_size, block_start);
+	if (listed) {
+		LOCK_LIST(list);
+	}
+	block_start->header = new_header;
 	*block_footer = new_header;
-	sf_block *list_head = get_relevant_free_list_head(block_size, block_start);
-	insert_into_free_list(block_start, list_head);
+	set_prev_allocation_flag(next_block, 0); /* Before the block can be allocated, which sets it */
+	if (listed) {
+		insert_into_free_list(block_start, &sf_free_list_heads[list]);
+		UNLOCK_LIST(list);
+	}
 	return block_start;
 }
 
+/*
+ * Unlinks the free block right before block and returns it, or returns NULL if that
+ * block is allocated.  Allocating that block sets block's prev-allocated bit before its
+ * footer can become payload, so the footer only counts if the bit is still clear after
+ * it was read.
+ */
+sf_block *unlink_free_prev(sf_block *block) {
+	sf_footer *prev_footer = ((void *) block) - 8;
+	while (!(READ_TAG(block->header) & PREV_BLOCK_ALLOCATED)) {
+		sf_footer footer = READ_TAG(*prev_footer);
+		size_t prev_size = footer & ~(0xF);
+		sf_block *prev_block = ((void *) block) - prev_size;
+		if (READ_TAG(block->header) & PREV_BLOCK_ALLOCATED) {
+			break;
+		}
+		if (prev_size < MIN_FREE_BLOCK_SIZE || unlink_if_unchanged(prev_block, footer)) {
+			return prev_block; /* Smaller blocks are never listed, so only coalescing changes them */
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Unlinks next_block and returns it if it is free, or returns NULL if it is allocated or
+ * the epilogue.
+ */
+sf_block *unlink_free_next(sf_block *next_block) {
+	if ((void *) next_block >= sf_mem_end() - 8) {
+		return NULL;
+	}
+	while (1) {
+		sf_header header = READ_TAG(next_block->header);
+		if (header & THIS_BLOCK_ALLOCATED) {
+			return NULL;
+		}
+		if ((header & ~(0xF)) < MIN_FREE_BLOCK_SIZE || unlink_if_unchanged(next_block, header)) {
+			return next_block;
+		}
+	}
+}
+
+/*
+ * Unlinks a free block if it still has the header it was seen with once its list is
+ * locked, and returns whether it did.  In SF_THREADS builds it may have been allocated
+ * off its list in the meantime, or moved to another list by new size classes, and is
+ * looked at again.
+ */
+int unlink_if_unchanged(sf_block *block, sf_header header) {
+#ifdef SF_THREADS
+	size_t size = header & ~(0xF);
+	int list = free_list_of(size, block);
+	LOCK_LIST(list);
+	int unchanged = block->header == header && free_list_of(size, block) == list;
+	if (unchanged) {
+		remove_from_free_list(block);
+	}
+	UNLOCK_LIST(list);
+	return unchanged;
+#else
+	remove_from_free_list(block);
+	return 1;
+#endif
+}
+
 void remove_from_free_list(sf_block *block) {
 	sf_block *prev = block->body.links.prev;
 	sf_block *next = block->body.links.next;
@@ -235,29 +628,44 @@ void remove_from_free_list(sf_block *block) {
 }
 
 
-int power(int base, int exp) {
-	if (exp < 0) {
-		return 0;
-	}
-	int result = 1;
-	for (int i = 0; i < exp; i++) {
-		result *= base;
-	}
-	return result;
-}
-
-
 void allocate_block(sf_block *block, size_t size) {
 	sf_header header = block->header;
 	header |= THIS_BLOCK_ALLOCATED;
 	header &= 0xF; /* Mask off the size bits */
 	header |= size;
 	block->header = header;
-	remove_from_free_list(block);
 	void *next_block = ((void *) block) + size;
 	set_prev_allocation_flag((sf_block *) next_block, 1);
 }
 
+/*
+ * Bump-pointer allocation out of the wilderness block: the allocated block takes over
+ * the wilderness header and the remainder replaces it in the wilderness list in place.
+ * Only the remainder's header is written; its footer at the end of the heap is left
+ * stale until something reads it (see write_wilderness_footer).
+ */
+void allocate_from_wilderness(sf_block *wilderness, size_t size) {
+	size_t wilderness_size = wilderness->header & ~(0xF);
+	sf_block *list_head = &sf_free_list_heads[7];
+	sf_block *remainder = ((void *) wilderness) + size;
+	wilderness->header = (wilderness->header & PREV_BLOCK_ALLOCATED) | size | THIS_BLOCK_ALLOCATED;
+	remainder->header = create_header(wilderness_size - size, 1, 0);
+	remainder->body.links.next = list_head;
+	remainder->body.links.prev = list_head;
+	list_head->body.links.next = remainder;
+	list_head->body.links.prev = remainder;
+	stamp_free_block(remainder);
+}
+
+void write_wilderness_footer() {
+	sf_block *wilderness = sf_free_list_heads[7].body.links.next;
+	if (wilderness == &sf_free_list_heads[7]) {
+		return;
+	}
+	sf_footer *footer = sf_mem_end() - 16; /* Footer sits right before the epilogue */
+	*footer = wilderness->header;
+}
+
 void set_prev_allocation_flag(sf_block *block, int prev_allocation) {
 	if ((void *) block >= sf_mem_end() - 8) { /* If in epilogue or out of bounds */
 		return;
@@ -266,7 +674,7 @@ void set_prev_allocation_flag(sf_block *block, int prev_allocation) {
 	sf_header new_header = header & ~(0x2);
 	prev_allocation <<= 1;
 	new_header = new_header | prev_allocation;
-	block->header = new_header;
+	WRITE_TAG(block->header, new_header);
 	int allocated = header & 0x1;
 	if (!allocated) { /* If block is not allocated, must set new footer too */
 		size_t block_size = header & ~(0xF);
@@ -284,30 +692,68 @@ void set_prev_allocation_flag(sf_block *block, int prev_allocation) {
 
 
 void sf_free(void *pp) {
+	if (TRACING()) {
+		sf_trace_free(pp);
+		return;
+	}
+	pp = colour_base(pp);
 	if (!valid_pointer(pp)) {
 		abort();
 	}
-	sf_block *block = (sf_block *) (pp - 8); /* Go to header of block */
-	block->header = block->header & ~(THIS_BLOCK_ALLOCATED);
-	sf_block *new_block = coalesce(block);
-	size_t new_block_size = (new_block->header) & ~(0xF);
-	set_prev_allocation_flag((void *) new_block + new_block_size, 0);
+	release_block((sf_block *) (pp - 8)); /* Go to header of block */
+	maybe_purge();
     return;
 }
 
+/*
+ * sf_free for callers that pass the size they asked for, such as C++ deallocation.
+ * The pointer is trusted, so valid_pointer only runs in debug builds, where the size is
+ * also checked against the header.  Blocks asked for with less than any size colouring
+ * ever started at were never coloured, so they skip the colour lookup as well.
+ */
+void sf_free_sized(void *pp, size_t size) {
+	if (TRACING()) {
+		sf_trace_free(pp);
+		return;
+	}
+	if (size >= colour_floor) {
+		pp = colour_base(pp);
+	}
+	sf_block *block = (sf_block *) (pp - 8);
+#ifdef DEBUG
+	if (!valid_pointer(pp) || (block->header & ~(0xF)) < size + 8) {
+		abort();
+	}
+#endif
+	release_block(block);
+	maybe_purge();
+}
+
+void release_block(sf_block *block) {
+	LOCK_BOUNDARY();
+	if (block == hot_block) {
+		hot_block = NULL;
+	}
+	coalesce(block);
+	UNLOCK_BOUNDARY();
+}
+
 int valid_pointer(void *pointer) {
 	if (pointer == NULL) goto INVALID;
+	size_t colour_offset = pointer - colour_base(pointer);
+	pointer -= colour_offset;
 	if ((uintptr_t) pointer % 16 != 0) goto INVALID;
 	sf_block *block = (sf_block *) (pointer - 8); /* Go to where header starts */
 	sf_header header = block->header;
 	size_t block_size = header & ~(0xF);
-	if (block_size % 16 != 0 || block_size < 32) goto INVALID;
+	if (block_size % 16 != 0 || block_size < MIN_BLOCK_SIZE) goto INVALID;
 	if (!(header & THIS_BLOCK_ALLOCATED)) goto INVALID;
+	if (colour_offset >= block_size - 8) goto INVALID;
 	if (((void *) block + block_size) > sf_mem_end() || ((void *) block + block_size + 8) > sf_mem_end()) goto INVALID;
 	sf_footer *prev_footer = (void *) block - 8;
 	int prev_allocated = (header & PREV_BLOCK_ALLOCATED) >> 1;
-	if (!prev_allocated) {
-		if ((*prev_footer & THIS_BLOCK_ALLOCATED) != prev_allocated) goto INVALID;
+	if (!prev_allocated) { /* Unless the block before was allocated since the header was read */
+		if ((READ_TAG(*prev_footer) & THIS_BLOCK_ALLOCATED) && !(READ_TAG(block->header) & PREV_BLOCK_ALLOCATED)) goto INVALID;
 	}
 	return 1;
 
@@ -325,13 +771,28 @@ int valid_pointer(void *pointer) {
 
 
 void *sf_realloc(void *pp, size_t rsize) {
+	if (TRACING()) {
+		return sf_trace_realloc(pp, rsize);
+	}
+	return realloc_block(pp, rsize);
+}
+
+/*
+ * sf_realloc without tracing.
+ */
+void *realloc_block(void *pp, size_t rsize) {
 	if (!valid_pointer(pp)) {
 		sf_errno = EINVAL;
 		return NULL;
 	} else if (rsize == 0) {
+		trace_realloc_release();
 		sf_free(pp);
 		return NULL;
 	}
+	void *base = colour_base(pp);
+	if (base != pp) {
+		return sf_realloc_coloured(pp, base, rsize);
+	}
 	sf_block *block = pp - 8; /* Go to start of block */
 	sf_header header = block->header;
 	size_t block_size = header & ~(0xF);
@@ -355,11 +816,13 @@ void *sf_realloc_larger(sf_block *block, size_t rsize) {
 	size_t payload_size = (header & ~(0xF)) - 8; /* Block size without header */
 	void *payload_start = (void *) block + 8;
 	memcpy(new_mem, payload_start, payload_size);
+	trace_realloc_release();
 	sf_free(payload_start);
 	return new_mem;
 }
 
 void *sf_realloc_smaller(sf_block *block, size_t rsize) {
+	LOCK_HEAP(); /* The block before may be allocated meanwhile, which rewrites this header */
 	sf_header header = block->header;
 	size_t block_size = header & ~(0xF);
 	size_t new_block_size = calculate_aligned_block_size(rsize);
@@ -369,10 +832,10 @@ void *sf_realloc_smaller(sf_block *block, size_t rsize) {
 		sf_header header = create_header(split_size, 1, 0);
 		split_block_addr->header = header;
 		coalesce(split_block_addr);
-		set_prev_allocation_flag((void *) split_block_addr + (split_block_addr->header & ~(0xF)), 0);
 		block->header &= 0xF;
 		block->header |= new_block_size;
 	}
+	UNLOCK_HEAP();
 	return ((void *) block + 8); /* Return start of payload */
 }
 
@@ -384,6 +847,9 @@ void *sf_realloc_smaller(sf_block *block, size_t rsize) {
 
 
 void *sf_memalign(size_t size, size_t align) {
+	if (TRACING()) {
+		return sf_trace_memalign(size, align);
+	}
 	if (align < 32 || !is_power_of_two(align)) {
 		sf_errno = EINVAL;
 		return NULL;
@@ -391,9 +857,10 @@ void *sf_memalign(size_t size, size_t align) {
 		return NULL;
 	}
 	size_t new_size = size + align + 32 + 8;
-	void *allocated = sf_malloc(new_size);
+	void *allocated = malloc_block(new_size); /* Colouring would undo the alignment */
 	void *aligned_addr = allocated;
 	if ((uintptr_t) allocated % align != 0) {
+		LOCK_HEAP();
 		aligned_addr = find_address_with_alignment(allocated, align);
 		size_t free_space = aligned_addr - allocated;
 		sf_block *block = allocated - 8;
@@ -403,6 +870,7 @@ void *sf_memalign(size_t size, size_t align) {
 		block = aligned_addr - 8;
 		block->header = create_header(allocated_size - free_space, 0, 1);
 		sf_free(allocated);
+		UNLOCK_HEAP();
 	}
 	return sf_realloc(aligned_addr, size);
 }
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * A saved heap is a sf_heap_image_header followed by the raw heap contents.  Free list
+ * links inside the image are stored as offsets from the start of the heap (or as
+ * SENTINEL_LINK(i) for the dummy head of list i), so the image can be loaded back at
+ * whatever address sf_mem_start() has in the restoring process.
+ */
+#define SENTINEL_LINK(i) (UINT64_MAX - (i))
+#define NULL_ROOT 0 /* Offset 0 is heap padding and never a payload */
+#define IMAGE_ALLOCATED 1 /* validate_heap_image marks for each 16 bytes of the image */
+#define IMAGE_LISTED 2
+#define IMAGE_FRAGMENT 3
+#define IMAGE_VISITED 4
+
+static void *roots[SF_NUM_ROOTS];
+
+int sf_set_root(int index, void *ptr) {
+	if (index < 0 || index >= SF_NUM_ROOTS) {
+		sf_errno = EINVAL;
+		return -1;
+	}
+	roots[index] = ptr;
+	return 0;
+}
+
+void *sf_get_root(int index) {
+	if (index < 0 || index >= SF_NUM_ROOTS) {
+		sf_errno = EINVAL;
+		return NULL;
+	}
+	return roots[index];
+}
+
+int sf_heap_save(int fd) {
+	struct sf_heap_image_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SF_HEAP_IMAGE_MAGIC, sizeof(SF_HEAP_IMAGE_MAGIC));
+	LOCK_HEAP();
+	header.heap_size = sf_mem_end() - sf_mem_start();
+	if (header.heap_size == 0) {
+		UNLOCK_HEAP();
+		return write_fully(fd, &header, sizeof(header));
+	}
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		header.list_links[i][0] = link_to_offset(sf_free_list_heads[i].body.links.next);
+		header.list_links[i][1] = link_to_offset(sf_free_list_heads[i].body.links.prev);
+	}
+	for (int i = 0; i < SF_NUM_ROOTS; i++) {
+		header.roots[i] = roots[i] == NULL ? NULL_ROOT : (uint64_t) (roots[i] - sf_mem_start());
+	}
+	write_wilderness_footer();
+	translate_free_links(1);
+	int result = write_fully(fd, &header, sizeof(header));
+	if (result == 0) {
+		result = write_fully(fd, sf_mem_start(), header.heap_size);
+	}
+	translate_free_links(0);
+	UNLOCK_HEAP();
+	return result;
+}
+
+int sf_heap_restore(int fd) {
+	LOCK_HEAP();
+	int result = load_heap_image(fd);
+	UNLOCK_HEAP();
+	return result;
+}
+
+/*
+ * The image is read into a scratch buffer and checked before the heap is touched.  If
+ * growing the heap fails part way, the pages it got are formatted as an empty heap, so
+ * the allocator never runs on a half-loaded one.
+ */
+int load_heap_image(int fd) {
+	struct sf_heap_image_header header;
+	if (sf_mem_start() != sf_mem_end()) { /* Only an untouched heap can be replaced */
+		sf_errno = EINVAL;
+		return -1;
+	}
+	if (read_fully(fd, &header, sizeof(header))) {
+		return -1;
+	}
+	if (memcmp(header.magic, SF_HEAP_IMAGE_MAGIC, sizeof(SF_HEAP_IMAGE_MAGIC)) != 0
+		|| header.heap_size % PAGE_SZ != 0) {
+		sf_errno = EINVAL;
+		return -1;
+	}
+	if (header.heap_size == 0) {
+		initialize_free_lists();
+		return 0;
+	}
+	void *image = malloc(header.heap_size);
+	if (image == NULL) {
+		sf_errno = ENOMEM;
+		return -1;
+	}
+	if (read_fully(fd, image, header.heap_size) || validate_heap_image(&header, image)) {
+		free(image);
+		return -1;
+	}
+	while ((size_t) (sf_mem_end() - sf_mem_start()) < header.heap_size) {
+		if (sf_mem_grow() == NULL) {
+			free(image);
+			if (sf_mem_start() != sf_mem_end()) {
+				format_heap();
+			}
+			return -1;
+		}
+	}
+	memcpy(sf_mem_start(), image, header.heap_size);
+	free(image);
+	initialize_free_lists();
+	translate_free_links(0);
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		sf_free_list_heads[i].body.links.next = offset_to_link(header.list_links[i][0]);
+		sf_free_list_heads[i].body.links.prev = offset_to_link(header.list_links[i][1]);
+	}
+	migrate_free_blocks(); /* The saving process may have adapted its size classes */
+	for (int i = 0; i < SF_NUM_ROOTS; i++) {
+		roots[i] = header.roots[i] == NULL_ROOT ? NULL : sf_mem_start() + header.roots[i];
+	}
+	return 0;
+}
+
+static uint64_t image_link(void *image, uint64_t offset, int prev) {
+	return *(uint64_t *) (image + offset + 8 + 8 * prev); /* Links follow the 8-byte header */
+}
+
+/*
+ * Checks that the blocks of an image tile it from the prologue to the epilogue, with
+ * matching footers and prev-allocated bits, that every free list leads from its head
+ * through listed blocks back to its head with matching prev links, that every listed
+ * block is on exactly one list, and that the roots are inside the heap.  Sets sf_errno
+ * to EINVAL and returns -1 if not.
+ */
+int validate_heap_image(struct sf_heap_image_header *header, void *image) {
+	size_t heap_size = header->heap_size;
+	size_t epilogue = heap_size - 8;
+	uint8_t *marks = calloc(heap_size / 16, 1);
+	if (marks == NULL) {
+		sf_errno = ENOMEM;
+		return -1;
+	}
+	size_t num_listed = 0;
+	size_t offset = 8 + 32; /* (8 + 32) = padding bytes + prologue bytes */
+	sf_header prologue = *(sf_header *) (image + 8);
+	int prev_allocated = 1;
+	if ((prologue & ~(0xF)) != 32 || !(prologue & THIS_BLOCK_ALLOCATED)) {
+		goto INVALID;
+	}
+	while (offset < epilogue) {
+		sf_header block_header = *(sf_header *) (image + offset);
+		size_t block_size = block_header & ~(0xF);
+		int allocated = block_header & THIS_BLOCK_ALLOCATED;
+		if (block_size < MIN_BLOCK_SIZE || block_size % 16 != 0 || block_size > epilogue - offset
+			|| !(block_header & PREV_BLOCK_ALLOCATED) != !prev_allocated) {
+			goto INVALID;
+		}
+		if (allocated) {
+			marks[offset / 16] = IMAGE_ALLOCATED;
+		} else if (*(sf_footer *) (image + offset + block_size - 8) != block_header) {
+			goto INVALID;
+		} else if (block_size >= MIN_FREE_BLOCK_SIZE) {
+			marks[offset / 16] = IMAGE_LISTED;
+			num_listed++;
+		} else {
+			marks[offset / 16] = IMAGE_FRAGMENT;
+		}
+		prev_allocated = allocated;
+		offset += block_size;
+	}
+	if (offset != epilogue) {
+		goto INVALID;
+	}
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		uint64_t prev = SENTINEL_LINK(i);
+		uint64_t link = header->list_links[i][0];
+		while (link != SENTINEL_LINK(i)) {
+			if (link >= heap_size || link % 16 != 8 || marks[link / 16] != IMAGE_LISTED
+				|| image_link(image, link, 1) != prev) {
+				goto INVALID; /* Not a listed block, already on a list, or a broken prev link */
+			}
+			marks[link / 16] |= IMAGE_VISITED;
+			num_listed--;
+			prev = link;
+			link = image_link(image, link, 0);
+		}
+		if (header->list_links[i][1] != prev) {
+			goto INVALID;
+		}
+	}
+	if (num_listed != 0) { /* Free blocks on no list */
+		goto INVALID;
+	}
+	for (int i = 0; i < SF_NUM_ROOTS; i++) {
+		if (header->roots[i] != NULL_ROOT && (header->roots[i] < 8 + 32 + 8 || header->roots[i] >= epilogue)) {
+			goto INVALID;
+		}
+	}
+	free(marks);
+	return 0;
+
+	INVALID:
+		free(marks);
+		sf_errno = EINVAL;
+		return -1;
+}
+
+/*
+ * Converts the links of every free block in the heap between pointers and offsets,
+ * walking the blocks in address order so the lists themselves are never followed.
+ */
+void translate_free_links(int to_offsets) {
+	sf_block *epilogue = sf_mem_end() - 8;
+	sf_block *block = sf_mem_start() + 8 + 32; /* (8 + 32) = padding bytes + prologue bytes */
+	while (block < epilogue) {
+		if (!(block->header & THIS_BLOCK_ALLOCATED) && (block->header & ~(0xF)) >= MIN_FREE_BLOCK_SIZE) {
+			uint64_t *next = (uint64_t *) &block->body.links.next;
+			uint64_t *prev = (uint64_t *) &block->body.links.prev;
+			if (to_offsets) {
+				*next = link_to_offset(block->body.links.next);
+				*prev = link_to_offset(block->body.links.prev);
+			} else {
+				block->body.links.next = offset_to_link(*next);
+				block->body.links.prev = offset_to_link(*prev);
+			}
+		}
+		block = ((void *) block) + (block->header & ~(0xF));
+	}
+}
+
+uint64_t link_to_offset(sf_block *link) {
+	if (link >= sf_free_list_heads && link < sf_free_list_heads + NUM_FREE_LISTS) {
+		return SENTINEL_LINK(link - sf_free_list_heads);
+	}
+	return ((void *) link) - sf_mem_start();
+}
+
+sf_block *offset_to_link(uint64_t offset) {
+	if (offset > SENTINEL_LINK(NUM_FREE_LISTS)) {
+		return &sf_free_list_heads[SENTINEL_LINK(0) - offset];
+	}
+	return sf_mem_start() + offset;
+}
@@ -0,0 +1,95 @@
+#define _DEFAULT_SOURCE /* madvise, MADV_DONTNEED, CLOCK_MONOTONIC_COARSE */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+static long purge_decay_ms = -1;
+static SF_THREAD_LOCAL unsigned int frees_since_purge = 0;
+static size_t system_page_size = 0;
+
+/* Milliseconds on a clock that only needs to be as fine as the decay time. */
+static uint64_t purge_clock_ms() {
+	struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* The idle stamp sits right after the links: (8 + 16) = header + links. */
+static uint64_t *idle_stamp(sf_block *block) {
+	return (uint64_t *) ((void *) block + 8 + 16);
+}
+
+void sf_set_purge_decay(long decay_ms) {
+	purge_decay_ms = decay_ms;
+}
+
+/*
+ * Called whenever a block goes onto a free list.  Merged and split blocks start idling
+ * again, which at worst keeps their pages a little longer.
+ */
+void stamp_free_block(sf_block *block) {
+	if ((block->header & ~(0xF)) >= SF_PURGE_MIN_SIZE) {
+		*idle_stamp(block) = purge_clock_ms() << 1;
+	}
+}
+
+void maybe_purge() {
+	if (purge_decay_ms < 0 || ++frees_since_purge < SF_PURGE_INTERVAL) {
+		return;
+	}
+	frees_since_purge = 0;
+	sf_purge(purge_decay_ms);
+}
+
+size_t sf_purge(long min_idle_ms) {
+	size_t purged = 0;
+	uint64_t now = purge_clock_ms();
+	LOCK_HEAP();
+	if (sf_mem_start() == sf_mem_end()) { /* Free lists are not set up yet */
+		UNLOCK_HEAP();
+		return 0;
+	}
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		sf_block *list_head = &sf_free_list_heads[i];
+		for (sf_block *block = list_head->body.links.next; block != list_head; block = block->body.links.next) {
+			purged += purge_block(block, now, min_idle_ms);
+		}
+	}
+	UNLOCK_HEAP();
+	return purged;
+}
+
+/*
+ * Purges the pages between the idle stamp and the footer of a free block idle for at
+ * least min_idle_ms.  Returns the number of bytes purged.
+ */
+size_t purge_block(sf_block *block, uint64_t now, long min_idle_ms) {
+	size_t block_size = block->header & ~(0xF);
+	if (block_size < SF_PURGE_MIN_SIZE) {
+		return 0;
+	}
+	uint64_t stamp = *idle_stamp(block);
+	if ((stamp & SF_PURGED) || (long) (now - (stamp >> 1)) < min_idle_ms) {
+		return 0;
+	}
+	if (system_page_size == 0) {
+		system_page_size = sysconf(_SC_PAGESIZE);
+	}
+	uintptr_t align = huge_pages_enabled ? SF_SEGMENT_SIZE : system_page_size;
+	uintptr_t from = ((uintptr_t) (idle_stamp(block) + 1) + align - 1) & ~(align - 1);
+	uintptr_t to = ((uintptr_t) block + block_size - 8) & ~(align - 1); /* Up to the footer */
+	*idle_stamp(block) = stamp | SF_PURGED; /* Nothing to gain from looking again */
+	if (to <= from || madvise((void *) from, to - from, MADV_DONTNEED) != 0) {
+		return 0;
+	}
+	return to - from;
+}
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+#define SNAPSHOT_BATCH 256 /* Block records buffered per write */
+#define MARK_LIST 0x0F      /* Free list number + 1, 0 if not listed */
+#define MARK_BLOCK 0x40     /* A block starts here */
+#define MARK_DUPLICATE 0x80 /* Listed more than once */
+
+int sf_heap_snapshot(int fd) {
+	LOCK_HEAP();
+	int result = write_heap_snapshot(fd);
+	UNLOCK_HEAP();
+	return result;
+}
+
+int write_heap_snapshot(int fd) {
+	struct sf_snapshot_header header;
+	uint64_t list_lengths[NUM_FREE_LISTS];
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SF_SNAPSHOT_MAGIC, sizeof(SF_SNAPSHOT_MAGIC));
+	header.heap_size = sf_mem_end() - sf_mem_start();
+	memset(list_lengths, 0, sizeof(list_lengths));
+	if (header.heap_size == 0) {
+		return write_fully(fd, &header, sizeof(header)) || write_fully(fd, list_lengths, sizeof(list_lengths)) ? -1 : 0;
+	}
+	uint8_t *marks = calloc(header.heap_size / 16, 1); /* One per 16 bytes of heap, see MARK_* */
+	if (marks == NULL) {
+		sf_errno = ENOMEM;
+		return -1;
+	}
+	int result = write_snapshot_blocks(fd, &header, list_lengths, marks);
+	free(marks);
+	return result;
+}
+
+/* Writes the header, list lengths and block records of a non-empty heap. */
+int write_snapshot_blocks(int fd, struct sf_snapshot_header *header, uint64_t *list_lengths, uint8_t *marks) {
+	struct sf_snapshot_block records[SNAPSHOT_BATCH];
+	void *heap_start = sf_mem_start();
+	sf_block *first_block = heap_start + 8 + 32; /* (8 + 32) = padding bytes + prologue bytes */
+	sf_block *epilogue = sf_mem_end() - 8;
+	sf_block *block;
+	header->stray_entries = mark_listed_blocks(marks, list_lengths);
+	for (block = first_block; block < epilogue; block = (void *) block + (block->header & ~(0xF))) {
+		marks[((void *) block - heap_start) / 16] |= MARK_BLOCK;
+		header->num_blocks++;
+	}
+	for (size_t i = 0; i < header->heap_size / 16; i++) {
+		if ((marks[i] & MARK_LIST) && !(marks[i] & MARK_BLOCK)) {
+			header->stray_entries++; /* Listed, but not the start of a block */
+		}
+	}
+	if (write_fully(fd, header, sizeof(*header)) || write_fully(fd, list_lengths, NUM_FREE_LISTS * sizeof(uint64_t))) {
+		return -1;
+	}
+	int batched = 0;
+	for (block = first_block; block < epilogue; block = (void *) block + (block->header & ~(0xF))) {
+		size_t block_size = block->header & ~(0xF);
+		uint8_t mark = marks[((void *) block - heap_start) / 16];
+		struct sf_snapshot_block *record = &records[batched++];
+		record->offset = (void *) block - heap_start;
+		record->size = block_size / 16;
+		record->flags = block->header & (THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED);
+		if (mark & MARK_DUPLICATE) {
+			record->flags |= SF_SNAPSHOT_DUPLICATE;
+		}
+		record->free_list = (int) (mark & MARK_LIST) - 1;
+		record->expected_list = -1;
+		record->reserved = 0;
+		if (!(block->header & THIS_BLOCK_ALLOCATED) && block_size >= MIN_FREE_BLOCK_SIZE) {
+			record->expected_list = get_relevant_free_list_head(block_size, block) - sf_free_list_heads;
+		}
+		if (batched == SNAPSHOT_BATCH) {
+			if (write_fully(fd, records, sizeof(records))) {
+				return -1;
+			}
+			batched = 0;
+		}
+	}
+	return write_fully(fd, records, batched * sizeof(records[0]));
+}
+
+/*
+ * Walks every free list and marks each entry with its list number plus one.  Counts the
+ * list lengths and returns the number of entries that point outside the heap, after
+ * which that list cannot be followed any further.  A list is also left as soon as it
+ * comes back to a block it already marked, as a cycle would.
+ */
+uint64_t mark_listed_blocks(uint8_t *marks, uint64_t *list_lengths) {
+	void *heap_start = sf_mem_start();
+	size_t heap_size = sf_mem_end() - heap_start;
+	uint64_t stray_entries = 0;
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		sf_block *head = &sf_free_list_heads[i];
+		for (sf_block *block = head->body.links.next; block != head; block = block->body.links.next) {
+			size_t offset = (void *) block - heap_start;
+			if ((void *) block < heap_start || offset + MIN_FREE_BLOCK_SIZE > heap_size || offset % 16 != 8) {
+				stray_entries++;
+				break;
+			}
+			list_lengths[i]++;
+			uint8_t *mark = &marks[offset / 16];
+			if (*mark & MARK_LIST) {
+				int seen_on = (*mark & MARK_LIST) - 1;
+				*mark |= MARK_DUPLICATE;
+				if (seen_on == i) {
+					break;
+				}
+				continue;
+			}
+			*mark |= i + 1;
+		}
+	}
+	return stray_entries;
+}
+
+int sf_snapshot_analyze(int fd, struct sf_snapshot_report *report) {
+	struct sf_snapshot_header header;
+	uint64_t list_lengths[NUM_FREE_LISTS];
+	struct sf_snapshot_block records[SNAPSHOT_BATCH];
+	memset(report, 0, sizeof(*report));
+	if (read_fully(fd, &header, sizeof(header)) || read_fully(fd, list_lengths, sizeof(list_lengths))) {
+		return -1;
+	}
+	if (memcmp(header.magic, SF_SNAPSHOT_MAGIC, sizeof(SF_SNAPSHOT_MAGIC)) != 0) {
+		sf_errno = EINVAL;
+		return -1;
+	}
+	report->heap_size = header.heap_size;
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		report->list_lengths[i] = list_lengths[i];
+	}
+	uint64_t remaining = header.num_blocks;
+	while (remaining > 0) {
+		size_t batched = remaining < SNAPSHOT_BATCH ? remaining : SNAPSHOT_BATCH;
+		if (read_fully(fd, records, batched * sizeof(records[0]))) {
+			return -1;
+		}
+		for (size_t i = 0; i < batched; i++) {
+			size_t block_size = (size_t) records[i].size * 16;
+			int free_list = records[i].free_list;
+			report->header_bytes += 8;
+			int expected_list = records[i].expected_list;
+			if (free_list >= NUM_FREE_LISTS || expected_list >= NUM_FREE_LISTS) {
+				sf_errno = EINVAL;
+				return -1;
+			}
+			if (records[i].flags & SF_SNAPSHOT_DUPLICATE) {
+				report->duplicate_blocks++;
+			}
+			if (free_list >= 0 && free_list != expected_list) {
+				report->misfiled_blocks++; /* Allocated, too small, or in the wrong class */
+			}
+			if (records[i].flags & THIS_BLOCK_ALLOCATED) {
+				report->allocated_blocks++;
+				report->allocated_bytes += block_size;
+				continue;
+			}
+			report->free_blocks++;
+			report->free_bytes += block_size;
+			if (expected_list < 0) { /* Too small to be listed */
+				report->fragment_blocks++;
+				continue;
+			}
+			if (free_list < 0) {
+				report->unlisted_blocks++;
+			}
+			report->class_free_blocks[expected_list]++;
+			report->class_free_bytes[expected_list] += block_size;
+			if (block_size > report->largest_free_block) {
+				report->largest_free_block = block_size;
+			}
+		}
+		remaining -= batched;
+	}
+	report->overhead_bytes = report->heap_size - report->allocated_bytes - report->free_bytes;
+	report->stray_entries = header.stray_entries;
+	return 0;
+}
+
+void sf_snapshot_print_report(FILE *out, struct sf_snapshot_report *report) {
+	double fragmentation = 0;
+	if (report->free_bytes > 0) {
+		fragmentation = 1.0 - (double) report->largest_free_block / report->free_bytes;
+	}
+	fprintf(out, "heap size:          %zu\n", report->heap_size);
+	fprintf(out, "allocated:          %zu bytes in %zu blocks\n", report->allocated_bytes, report->allocated_blocks);
+	fprintf(out, "free:               %zu bytes in %zu blocks\n", report->free_bytes, report->free_blocks);
+	fprintf(out, "largest free block: %zu\n", report->largest_free_block);
+	fprintf(out, "fragmentation:      %.3f\n", fragmentation);
+	fprintf(out, "header bytes:       %zu\n", report->header_bytes);
+	fprintf(out, "overhead bytes:     %zu\n", report->overhead_bytes);
+	fprintf(out, "unlisted blocks:    %zu\n", report->unlisted_blocks);
+	fprintf(out, "misfiled blocks:    %zu\n", report->misfiled_blocks);
+	fprintf(out, "duplicate blocks:   %zu\n", report->duplicate_blocks);
+	fprintf(out, "stray list entries: %zu\n", report->stray_entries);
+	fprintf(out, "fragment blocks:    %zu\n", report->fragment_blocks);
+	fprintf(out, "list  length  free blocks  free bytes\n");
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		fprintf(out, "%4d  %6zu  %11zu  %10zu\n", i, report->list_lengths[i],
+			report->class_free_blocks[i], report->class_free_bytes[i]);
+	}
+}
+
+int write_fully(int fd, void *buf, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			sf_errno = errno;
+			return -1;
+		}
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+
+int read_fully(int fd, void *buf, size_t len) {
+	while (len > 0) {
+		ssize_t count = read(fd, buf, len);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			sf_errno = count < 0 ? errno : EIO;
+			return -1;
+		}
+		buf += count;
+		len -= count;
+	}
+	return 0;
+}
@@ -0,0 +1,419 @@
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef SF_THREADS
+#include <pthread.h>
+#endif
+#include "debug.h"
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Allocation tracing.  While a trace is running, each public allocator call is recorded
+ * as one fixed-size sf_trace_record in a ring, which is written out whenever it fills up
+ * and on sf_trace_flush and sf_trace_stop.  Calls the allocator makes to itself
+ * (sf_realloc calling sf_malloc, for example) are not recorded, because trace_suppressed
+ * is set around the real call.
+ *
+ * In SF_THREADS builds every thread has its own ring.  Only the owning thread adds to it,
+ * and whoever writes it out holds trace_write_lock, so sf_trace_flush and sf_trace_stop
+ * can write out every thread's ring, and a thread that exits writes out its own.  Rings
+ * are written out in no particular order, which is why sf_trace_decode sorts the records
+ * by timestamp.  For that to put every call in the order the heap saw it, a call is
+ * stamped after it got its block and before it gave its block back: sf_malloc and
+ * sf_memalign when they return, sf_free when it is called, and sf_realloc where it moves
+ * the block (trace_realloc_release) or, if it does not, when it returns.
+ */
+#define TRACE_RING_RECORDS 1024
+
+struct trace_ring {
+	struct sf_trace_record records[TRACE_RING_RECORDS];
+	uint64_t head;            /* Records added, only by the owning thread */
+	uint64_t tail;            /* Records written out, under trace_write_lock */
+	int in_use;
+	struct trace_ring *next;
+};
+
+int sf_trace_active = 0;
+SF_THREAD_LOCAL int trace_suppressed = 0;
+static int trace_fd = -1;
+static SF_THREAD_LOCAL uint32_t trace_thread = 0;
+static SF_THREAD_LOCAL uint64_t realloc_released_at = 0;
+#ifdef SF_THREADS
+static pthread_mutex_t trace_write_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_TRACE() pthread_mutex_lock(&trace_write_lock)
+#define UNLOCK_TRACE() pthread_mutex_unlock(&trace_write_lock)
+#else
+#define LOCK_TRACE()
+#define UNLOCK_TRACE()
+#endif
+
+/*
+ * Writes out the records of a ring that have not been written yet, with trace_write_lock
+ * held in SF_THREADS builds.  Records are dropped if there is no trace file.
+ */
+static int write_trace_ring(struct trace_ring *ring) {
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail;
+	int result = 0;
+	while (trace_fd >= 0 && tail != head && result == 0) {
+		size_t first = tail % TRACE_RING_RECORDS;
+		size_t count = head - tail;
+		if (count > TRACE_RING_RECORDS - first) { /* Wraps around the end of the ring */
+			count = TRACE_RING_RECORDS - first;
+		}
+		result = write_fully(trace_fd, &ring->records[first], count * sizeof(ring->records[0]));
+		tail += count;
+	}
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+	return result;
+}
+
+#ifdef SF_THREADS
+static uint32_t trace_threads = 0;        /* Threads that have recorded an event */
+static struct trace_ring *trace_rings = NULL; /* Every ring, guarded by trace_write_lock */
+static SF_THREAD_LOCAL struct trace_ring *thread_ring = NULL;
+static pthread_key_t trace_exit_key;
+static pthread_once_t trace_exit_once = PTHREAD_ONCE_INIT;
+
+static void create_trace_exit_key() {
+	pthread_key_create(&trace_exit_key, trace_thread_exit);
+}
+
+/*
+ * The calling thread's ring, taken over from an exited thread or allocated on first use.
+ * NULL if there is no memory for one, in which case the thread's events are dropped.
+ */
+static struct trace_ring *own_ring() {
+	if (thread_ring != NULL) {
+		return thread_ring;
+	}
+	struct trace_ring *ring;
+	LOCK_TRACE();
+	for (ring = trace_rings; ring != NULL && ring->in_use; ring = ring->next);
+	if (ring == NULL && (ring = calloc(1, sizeof(*ring))) != NULL) {
+		ring->next = trace_rings;
+		trace_rings = ring;
+	}
+	if (ring != NULL) {
+		ring->in_use = 1;
+	}
+	UNLOCK_TRACE();
+	if (ring != NULL) {
+		pthread_once(&trace_exit_once, create_trace_exit_key);
+		pthread_setspecific(trace_exit_key, ring);
+		thread_ring = ring;
+	}
+	return ring;
+}
+
+/*
+ * Destructor of trace_exit_key.  Writes out the thread's records and leaves its ring to
+ * the next thread that starts recording.
+ */
+void trace_thread_exit(void *ring) {
+	LOCK_TRACE();
+	write_trace_ring(ring);
+	((struct trace_ring *) ring)->in_use = 0;
+	UNLOCK_TRACE();
+	thread_ring = NULL;
+}
+#else
+static struct trace_ring process_ring;
+static struct trace_ring *trace_rings = &process_ring;
+
+static struct trace_ring *own_ring() {
+	return &process_ring;
+}
+#endif
+
+int sf_trace_start(int fd) {
+	if (fd < 0) {
+		sf_errno = EINVAL;
+		return -1;
+	}
+	LOCK_TRACE();
+	trace_fd = fd;
+	for (struct trace_ring *ring = trace_rings; ring != NULL; ring = ring->next) {
+		__atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	}
+	UNLOCK_TRACE();
+	sf_trace_active = 1;
+	return 0;
+}
+
+int sf_trace_stop() {
+	sf_trace_active = 0;
+	int result = sf_trace_flush();
+	trace_fd = -1;
+	return result;
+}
+
+int sf_trace_flush() {
+	int result = 0;
+	LOCK_TRACE();
+	for (struct trace_ring *ring = trace_rings; ring != NULL; ring = ring->next) {
+		if (write_trace_ring(ring)) {
+			result = -1;
+		}
+	}
+	UNLOCK_TRACE();
+	return result;
+}
+
+/*
+ * The process id, or in SF_THREADS builds the order in which the thread first recorded
+ * an event, starting from 1.
+ */
+uint32_t trace_thread_id() {
+	if (trace_thread == 0) {
+#ifdef SF_THREADS
+		trace_thread = __sync_add_and_fetch(&trace_threads, 1);
+#else
+		trace_thread = getpid();
+#endif
+	}
+	return trace_thread;
+}
+
+uint64_t trace_offset(void *ptr) {
+	if (ptr < sf_mem_start() || ptr >= sf_mem_end()) { /* NULL or not a heap pointer */
+		return SF_TRACE_NULL;
+	}
+	return ptr - sf_mem_start();
+}
+
+uint64_t trace_clock() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_event(int op, size_t size, uint64_t arg, void *result, uint64_t timestamp) {
+	struct trace_ring *ring = own_ring();
+	if (ring == NULL) {
+		return;
+	}
+	uint64_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_RECORDS) {
+		LOCK_TRACE(); /* Full, so make room */
+		write_trace_ring(ring);
+		UNLOCK_TRACE();
+	}
+	struct sf_trace_record *record = &ring->records[head % TRACE_RING_RECORDS];
+	record->timestamp = timestamp;
+	record->size = size;
+	record->arg = arg;
+	record->result = trace_offset(result);
+	record->thread = trace_thread_id();
+	record->op = op;
+	record->reserved = 0;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Called by sf_realloc right before it frees the block it moved away from. */
+void trace_realloc_release() {
+	if (sf_trace_active && trace_suppressed && realloc_released_at == 0) {
+		realloc_released_at = trace_clock();
+	}
+}
+
+void *sf_trace_malloc(size_t size) {
+	trace_suppressed = 1;
+	void *result = sf_malloc(size);
+	trace_suppressed = 0;
+	trace_event(SF_TRACE_MALLOC, size, 0, result, trace_clock());
+	return result;
+}
+
+void *sf_trace_malloc_hint(size_t size, int hints) {
+	trace_suppressed = 1;
+	void *result = sf_malloc_hint(size, hints);
+	trace_suppressed = 0;
+	trace_event(SF_TRACE_MALLOC, size, hints, result, trace_clock());
+	return result;
+}
+
+void sf_trace_free(void *pp) {
+	trace_event(SF_TRACE_FREE, 0, trace_offset(pp), NULL, trace_clock());
+	if (!valid_pointer(pp)) { /* sf_free is about to abort */
+		sf_trace_flush();
+	}
+	trace_suppressed = 1;
+	sf_free(pp);
+	trace_suppressed = 0;
+}
+
+void *sf_trace_realloc(void *pp, size_t rsize) {
+	uint64_t offset = trace_offset(pp);
+	realloc_released_at = 0;
+	trace_suppressed = 1;
+	void *result = sf_realloc(pp, rsize);
+	trace_suppressed = 0;
+	uint64_t timestamp = realloc_released_at != 0 ? realloc_released_at : trace_clock();
+	realloc_released_at = 0;
+	trace_event(SF_TRACE_REALLOC, rsize, offset, result, timestamp);
+	return result;
+}
+
+void *sf_trace_memalign(size_t size, size_t align) {
+	trace_suppressed = 1;
+	void *result = sf_memalign(size, align);
+	trace_suppressed = 0;
+	trace_event(SF_TRACE_MEMALIGN, size, align, result, trace_clock());
+	return result;
+}
+
+/*
+ * Decodes a binary trace into a replayable text trace with one request per line:
+ *
+ *   a <id> <size>           allocate (sf_malloc or sf_malloc_hint)
+ *   m <id> <size> <align>   aligned allocate (sf_memalign)
+ *   r <id> <size>           reallocate block <id>
+ *   f <id>                  free block <id>
+ *
+ * Blocks are numbered in allocation order.  Requests that failed are skipped.  The
+ * records are replayed in timestamp order, since the rings of different threads are
+ * written out in no particular order; records with the same timestamp keep their order.
+ */
+int sf_trace_decode(int fd, FILE *out) {
+	size_t num_records;
+	struct sf_trace_record *records = read_trace_records(fd, &num_records);
+	if (records == NULL) {
+		return -1;
+	}
+	if (num_records > 1) {
+		struct sf_trace_record *scratch = malloc(num_records * sizeof(*records));
+		if (scratch == NULL) {
+			free(records);
+			sf_errno = ENOMEM;
+			return -1;
+		}
+		sort_trace_records(records, scratch, num_records);
+		free(scratch);
+	}
+	size_t ids_len = 0;
+	long *ids = NULL; /* Block id by payload offset / 16, or -1 */
+	long next_id = 0;
+	int result = 0;
+	for (size_t n = 0; n < num_records && result == 0; n++) {
+		struct sf_trace_record record = records[n];
+		uint64_t offsets[2] = { record.arg, record.result };
+		for (int i = 0; i < 2; i++) {
+			if (offsets[i] != SF_TRACE_NULL && offsets[i] / 16 >= ids_len) {
+				size_t new_len = offsets[i] / 16 + 1024;
+				long *new_ids = realloc(ids, new_len * sizeof(long));
+				if (new_ids == NULL) {
+					free(ids);
+					free(records);
+					sf_errno = ENOMEM;
+					return -1;
+				}
+				memset(new_ids + ids_len, -1, (new_len - ids_len) * sizeof(long));
+				ids = new_ids;
+				ids_len = new_len;
+			}
+		}
+		long id;
+		switch (record.op) {
+		case SF_TRACE_MALLOC:
+		case SF_TRACE_MEMALIGN:
+			if (record.result == SF_TRACE_NULL) {
+				break;
+			}
+			id = next_id++;
+			ids[record.result / 16] = id;
+			if (record.op == SF_TRACE_MALLOC) {
+				fprintf(out, "a %ld %lu\n", id, (unsigned long) record.size);
+			} else {
+				fprintf(out, "m %ld %lu %lu\n", id, (unsigned long) record.size, (unsigned long) record.arg);
+			}
+			break;
+		case SF_TRACE_REALLOC:
+			if (record.arg == SF_TRACE_NULL || ids[record.arg / 16] < 0) {
+				break;
+			}
+			id = ids[record.arg / 16];
+			if (record.size == 0) {
+				fprintf(out, "f %ld\n", id);
+				ids[record.arg / 16] = -1;
+			} else if (record.result != SF_TRACE_NULL) {
+				fprintf(out, "r %ld %lu\n", id, (unsigned long) record.size);
+				ids[record.arg / 16] = -1;
+				ids[record.result / 16] = id;
+			}
+			break;
+		case SF_TRACE_FREE:
+			if (record.arg == SF_TRACE_NULL || ids[record.arg / 16] < 0) {
+				break;
+			}
+			fprintf(out, "f %ld\n", ids[record.arg / 16]);
+			ids[record.arg / 16] = -1;
+			break;
+		default:
+			sf_errno = EINVAL;
+			result = -1;
+			break;
+		}
+	}
+	free(ids);
+	free(records);
+	return result;
+}
+
+/*
+ * Reads every record of a trace into an array the caller frees, and stores how many
+ * there are in num_records.  Returns NULL if the trace cannot be read or ends in the
+ * middle of a record.
+ */
+struct sf_trace_record *read_trace_records(int fd, size_t *num_records) {
+	size_t capacity = TRACE_RING_RECORDS;
+	size_t count = 0;
+	struct sf_trace_record *records = malloc(capacity * sizeof(*records));
+	while (records != NULL) {
+		if (count == capacity) {
+			struct sf_trace_record *new_records = realloc(records, 2 * capacity * sizeof(*records));
+			if (new_records == NULL) {
+				break;
+			}
+			records = new_records;
+			capacity *= 2;
+		}
+		ssize_t bytes = read(fd, &records[count], sizeof(*records));
+		if (bytes == 0) {
+			*num_records = count;
+			return records;
+		}
+		if (bytes < 0 || (bytes != sizeof(*records) && read_fully(fd, (void *) &records[count] + bytes, sizeof(*records) - bytes))) {
+			free(records);
+			return NULL;
+		}
+		count++;
+	}
+	free(records);
+	sf_errno = ENOMEM;
+	return NULL;
+}
+
+/* Stable merge sort of records by timestamp, using scratch for as many records. */
+void sort_trace_records(struct sf_trace_record *records, struct sf_trace_record *scratch, size_t count) {
+	if (count < 2) {
+		return;
+	}
+	size_t half = count / 2;
+	sort_trace_records(records, scratch, half);
+	sort_trace_records(records + half, scratch, count - half);
+	size_t left = 0, right = half;
+	for (size_t i = 0; i < count; i++) {
+		if (right == count || (left < half && records[left].timestamp <= records[right].timestamp)) {
+			scratch[i] = records[left++];
+		} else {
+			scratch[i] = records[right++];
+		}
+	}
+	memcpy(records, scratch, count * sizeof(*records));
+}
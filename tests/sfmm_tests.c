@@ -1,8 +1,16 @@
 #include <criterion/criterion.h>
 #include <errno.h>
 #include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "my_sfmm.h"
+#ifdef SF_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 #define TEST_TIMEOUT 15
 
 /*
@@ -41,7 +49,7 @@ Test(sfmm_basecode_suite, malloc_an_int, .timeout = TEST_TIMEOUT) {
 	cr_assert(*x == 4, "sf_malloc failed to give proper space for an int!");
 
 	assert_free_block_count(0, 1);
-	assert_free_block_count(8112, 1);
+	assert_free_block_count(8144 - SF_BLOCK_SIZE(sz), 1);
 
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 	cr_assert(sf_mem_start() + 8192 == sf_mem_end(), "Allocated more than necessary!");
@@ -79,7 +87,7 @@ Test(sfmm_basecode_suite, free_no_coalesce, .timeout = TEST_TIMEOUT) {
 
 	assert_free_block_count(0, 2);
 	assert_free_block_count(208, 1);
-	assert_free_block_count(7872, 1);
+	assert_free_block_count(8144 - SF_BLOCK_SIZE(sz_x) - 208 - SF_BLOCK_SIZE(sz_z), 1);
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
 
@@ -96,7 +104,7 @@ Test(sfmm_basecode_suite, free_coalesce, .timeout = TEST_TIMEOUT) {
 
 	assert_free_block_count(0, 2);
 	assert_free_block_count(528, 1);
-	assert_free_block_count(7552, 1);
+	assert_free_block_count(8144 - SF_BLOCK_SIZE(sz_w) - 528 - SF_BLOCK_SIZE(sz_z), 1);
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
 
@@ -138,9 +146,11 @@ Test(sfmm_basecode_suite, realloc_larger_block, .timeout = TEST_TIMEOUT) {
 		  "Realloc'ed block size (0x%ld) not what was expected (0x%ld)!",
 		  bp->header & ~0xf, 96);
 
-	assert_free_block_count(0, 2);
-	assert_free_block_count(32, 1);
-	assert_free_block_count(7984, 1);
+	// In compact builds the freed x is a fragment too small to be listed.
+	int x_listed = SF_BLOCK_SIZE(sz_x) >= MIN_FREE_BLOCK_SIZE;
+	assert_free_block_count(0, 1 + x_listed);
+	assert_free_block_count(SF_BLOCK_SIZE(sz_x), x_listed);
+	assert_free_block_count(8144 - SF_BLOCK_SIZE(sz_x) - SF_BLOCK_SIZE(sz_y) - 96, 1);
 }
 
 Test(sfmm_basecode_suite, realloc_smaller_block_splinter, .timeout = TEST_TIMEOUT) {
@@ -169,12 +179,12 @@ Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIME
 
 	sf_block *bp = (sf_block *)((char *)x - 8);
 	cr_assert(bp->header & 0x1, "Allocated bit is not set!");
-	cr_assert((bp->header & ~0xf) == 32, "Realloc'ed block size not what was expected!");
+	cr_assert((bp->header & ~0xf) == SF_BLOCK_SIZE(sz_y), "Realloc'ed block size not what was expected!");
 
 	// After realloc'ing x, we can return a block of size 48
 	// to the freelist.  This block will go into the main freelist and be coalesced.
 	assert_free_block_count(0, 1);
-	assert_free_block_count(8112, 1);
+	assert_free_block_count(8144 - SF_BLOCK_SIZE(sz_y), 1);
 }
 //############################################
 //STUDENT UNIT TESTS SHOULD BE WRITTEN BELOW
@@ -207,7 +217,7 @@ Test(sfmm_basecode_suite, memalign_address_already_aligned, .timeout = TEST_TIME
 	void *y = sf_memalign(8, align);
 	cr_assert_not_null(y, "y is NULL!");
 	assert_free_block_count(0, 1);
-	assert_free_block_count(8144 - (malloc_size + 8 + 32), 1); // 8144 = size of free block after heap initalization, (malloc_size + 8 + 32) = size of all allocated blocks
+	assert_free_block_count(8144 - (malloc_size + 8 + SF_BLOCK_SIZE(8)), 1); // 8144 = size of free block after heap initalization, (malloc_size + 8 + SF_BLOCK_SIZE(8)) = size of all allocated blocks
 	cr_assert(x + malloc_size + 8 == y, "Memalign allocation not at the right address");
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
@@ -220,7 +230,7 @@ Test(sfmm_basecode_suite, malloc_expand_heap_no_wilderness_block, .timeout = TES
 	void *mem_end = sf_mem_end();
 	void *y = sf_malloc(8);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(PAGE_SZ - 32, 1);
+	assert_free_block_count(PAGE_SZ - SF_BLOCK_SIZE(8), 1);
 
 	cr_assert(y == mem_end, "New allocation not at the right address");
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
@@ -247,7 +257,772 @@ Test(sfmm_basecode_suite, realloc_invalid_pointer, .timeout = TEST_TIMEOUT) {
 	void *y = sf_realloc(x - 8, 1500);
 
 	assert_free_block_count(0, 1);
-	assert_free_block_count(8112, 1);
+	assert_free_block_count(8144 - SF_BLOCK_SIZE(8), 1);
 	cr_assert_null(y, "y is not NULL!");
 	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
-}
\ No newline at end of file
+}
+
+Test(sfmm_basecode_suite, heap_snapshot_report, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(8);
+	/* void *y = */ sf_malloc(200);
+	/* void *z = */ sf_malloc(1);
+	sf_free(x);
+
+	int fds[2];
+	cr_assert(pipe(fds) == 0, "Could not create snapshot pipe!");
+	cr_assert(sf_heap_snapshot(fds[1]) == 0, "sf_heap_snapshot failed!");
+	close(fds[1]);
+
+	struct sf_snapshot_report report;
+	cr_assert(sf_snapshot_analyze(fds[0], &report) == 0, "sf_snapshot_analyze failed!");
+	cr_assert(report.heap_size == PAGE_SZ, "Wrong heap size in snapshot!");
+	size_t wilderness_size = 8144 - SF_BLOCK_SIZE(8) - 208 - SF_BLOCK_SIZE(1);
+	int x_listed = SF_BLOCK_SIZE(8) >= MIN_FREE_BLOCK_SIZE; /* Not in compact builds */
+	cr_assert(report.allocated_blocks == 2 && report.allocated_bytes == 208 + SF_BLOCK_SIZE(1), "Wrong allocated totals!");
+	cr_assert(report.free_blocks == 2 && report.free_bytes == SF_BLOCK_SIZE(8) + wilderness_size, "Wrong free totals!");
+	cr_assert(report.largest_free_block == wilderness_size, "Wrong largest free block!");
+	cr_assert(report.class_free_blocks[0] == x_listed && report.list_lengths[7] == 1, "Wrong free list breakdown!");
+	cr_assert(report.fragment_blocks == !x_listed, "Wrong fragment blocks!");
+	cr_assert(report.overhead_bytes == 8 + 32 + 8, "Wrong overhead bytes!");
+	cr_assert(report.unlisted_blocks == 0, "Free blocks missing from their lists!");
+	close(fds[0]);
+}
+
+static void analyze_snapshot(struct sf_snapshot_report *report) {
+	int fds[2];
+	cr_assert(pipe(fds) == 0, "Could not create snapshot pipe!");
+	cr_assert(sf_heap_snapshot(fds[1]) == 0, "sf_heap_snapshot failed!");
+	close(fds[1]);
+	cr_assert(sf_snapshot_analyze(fds[0], report) == 0, "sf_snapshot_analyze failed!");
+	close(fds[0]);
+}
+
+Test(sfmm_basecode_suite, heap_snapshot_checks_list_membership, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	/* void *x = */ sf_malloc(8);
+	void *y = sf_malloc(200);
+	/* void *z = */ sf_malloc(1);
+	sf_free(y);
+	sf_block *block = y - 8;
+	struct sf_snapshot_report report;
+
+	remove_from_free_list(block);
+	analyze_snapshot(&report);
+	cr_assert(report.unlisted_blocks == 1 && report.misfiled_blocks == 0, "Unlisted block not reported!");
+
+	insert_into_free_list(block, &sf_free_list_heads[6]);
+	analyze_snapshot(&report);
+	cr_assert(report.unlisted_blocks == 0 && report.misfiled_blocks == 1, "Misfiled block not reported!");
+	cr_assert(report.duplicate_blocks == 0 && report.stray_entries == 0, "Wrong list entries reported!");
+
+	remove_from_free_list(block);
+	insert_into_free_list(block, get_relevant_free_list_head(block->header & ~(0xF), block));
+	analyze_snapshot(&report);
+	cr_assert(report.unlisted_blocks == 0 && report.misfiled_blocks == 0, "Free lists not consistent!");
+}
+
+Test(sfmm_basecode_suite, malloc_wilderness_then_expand, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(100);
+	cr_assert(y == x + 112, "Wilderness allocation not at the right address");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(7920, 1);
+	cr_assert(sf_free_list_heads[7].body.links.next == y + 104, "Wilderness block not in the wilderness list!");
+
+	// Growing the heap must coalesce the new page with the shrunken wilderness block.
+	void *z = sf_malloc(9000);
+	cr_assert(z == y + 112, "Expanded allocation not at the right address");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(7104, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, malloc_hint_short_and_long, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *s = sf_malloc_hint(100, SF_HINT_SHORT);
+	cr_assert(s == sf_mem_end() - 8 - 112 + 8, "Short-lived block not at the end of the heap");
+	void *l = sf_malloc_hint(100, SF_HINT_LONG);
+	cr_assert(l == sf_mem_start() + 8 + 32 + 8, "Long-lived block not at the start of the heap");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(8144 - 224, 1);
+
+	sf_free(s);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(8144 - 112, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, malloc_hint_long_reuses_lowest_hole, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc_hint(100, SF_HINT_LONG);
+	void *b = sf_malloc_hint(100, SF_HINT_LONG);
+	void *c = sf_malloc(300);
+	/* void *d = */ sf_malloc_hint(100, SF_HINT_LONG);
+	sf_free(c);
+	void *e = sf_malloc_hint(200, SF_HINT_LONG);
+	cr_assert(e == c, "Long-lived block not in the lowest hole that fits");
+
+	// Freeing below the holes already passed over must bring the search back down.
+	sf_free(a);
+	void *f = sf_malloc_hint(100, SF_HINT_LONG);
+	cr_assert(f == a, "Long-lived block not in the freed hole at the start of the heap");
+	cr_assert(b == a + 112, "Long-lived blocks not packed");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, malloc_hint_hot, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc(20);
+	void *h1 = sf_malloc_hint(20, SF_HINT_HOT);
+	void *y = sf_malloc(20);
+	/* void *z = */ sf_malloc(20);
+	sf_free(y);
+	sf_free(a);
+
+	// The hole after h1 is preferred over the more recently freed hole at a.
+	void *h2 = sf_malloc_hint(20, SF_HINT_HOT);
+	cr_assert(h2 == h1 + 32, "Hot block not placed after the previous hot block");
+	assert_free_block_count(32, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, heap_save_and_restore, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	int fds[2];
+	cr_assert(pipe(fds) == 0, "Could not create image pipe!");
+	pid_t pid = fork();
+	if (pid == 0) { /* The saving process has its own heap */
+		close(fds[0]);
+		long *list = sf_malloc(10 * sizeof(long));
+		void *hole = sf_malloc(200);
+		/* void *z = */ sf_malloc(1);
+		for (int i = 0; i < 10; i++) {
+			list[i] = i * i;
+		}
+		sf_free(hole);
+		sf_set_root(0, list);
+		exit(sf_heap_save(fds[1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	close(fds[1]);
+	cr_assert(sf_heap_restore(fds[0]) == 0, "sf_heap_restore failed!");
+	int status;
+	waitpid(pid, &status, 0);
+	cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "sf_heap_save failed!");
+
+	long *list = sf_get_root(0);
+	cr_assert_not_null(list, "Root was not restored!");
+	for (int i = 0; i < 10; i++) {
+		cr_assert(list[i] == i * i, "Restored data is wrong!");
+	}
+	assert_free_block_count(0, 2);
+	assert_free_block_count(208, 1);
+	assert_free_block_count(8144 - 96 - 208 - SF_BLOCK_SIZE(1), 1);
+
+	// The restored free lists must be usable.
+	void *x = sf_malloc(200);
+	cr_assert(x == (void *) list + 96, "Restored hole not reused");
+	sf_free(list);
+	assert_free_block_count(96, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+/*
+ * Returns a pipe that a child process writes an image of an empty heap of heap_size
+ * bytes into: one free block on the wilderness list, whose prev link in the list head
+ * is wilderness_prev.  Only the first length bytes of the heap contents are written.
+ */
+static int empty_heap_image(size_t heap_size, size_t length, uint64_t wilderness_prev) {
+	int fds[2];
+	cr_assert(pipe(fds) == 0, "Could not create image pipe!");
+	if (fork() != 0) {
+		close(fds[1]);
+		return fds[0];
+	}
+	close(fds[0]);
+	struct sf_heap_image_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SF_HEAP_IMAGE_MAGIC, sizeof(SF_HEAP_IMAGE_MAGIC));
+	header.heap_size = heap_size;
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		header.list_links[i][0] = header.list_links[i][1] = UINT64_MAX - i;
+	}
+	header.list_links[7][0] = 40;
+	header.list_links[7][1] = wilderness_prev;
+	uint64_t *heap = calloc(heap_size / 8, 8);
+	heap[1] = create_header(32, 0, 1);
+	heap[5] = create_header(heap_size - 48, 1, 0);
+	heap[6] = heap[7] = UINT64_MAX - 7;
+	heap[heap_size / 8 - 2] = heap[5];
+	exit(write_fully(fds[1], &header, sizeof(header)) || write_fully(fds[1], heap, length));
+}
+
+Test(sfmm_basecode_suite, heap_restore_rejects_bad_images, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	int fd = empty_heap_image(2 * PAGE_SZ, 3000, 40);
+	cr_assert(sf_heap_restore(fd) == -1, "Truncated image was restored!");
+	cr_assert(sf_mem_start() == sf_mem_end(), "Heap was grown for a truncated image");
+	close(fd);
+
+	fd = empty_heap_image(PAGE_SZ, PAGE_SZ, 56); /* Not a block */
+	cr_assert(sf_heap_restore(fd) == -1, "Image with a broken list was restored!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+	cr_assert(sf_mem_start() == sf_mem_end(), "Heap was grown for a broken image");
+	close(fd);
+
+	// An image bigger than sf_mem_grow allows is valid, but cannot be loaded.
+	fd = empty_heap_image(20 * PAGE_SZ, 20 * PAGE_SZ, 40);
+	cr_assert(sf_heap_restore(fd) == -1, "Image bigger than the heap limit was restored!");
+	cr_assert(sf_mem_start() != sf_mem_end(), "Heap was not grown");
+	close(fd);
+	size_t heap_size = sf_mem_end() - sf_mem_start();
+	assert_free_block_count(0, 1);
+	assert_free_block_count(heap_size - 48, 1);
+	void *x = sf_malloc(100);
+	cr_assert(x == sf_mem_start() + 48, "Heap left behind is not empty");
+	sf_free(x);
+	assert_free_block_count(heap_size - 48, 1);
+}
+
+#ifdef SF_COMPACT_BLOCKS
+Test(sfmm_basecode_suite, compact_small_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(1);
+	void *y = sf_malloc(8);
+	void *z = sf_malloc(8);
+	cr_assert(y == x + 16 && z == y + 16, "Small blocks are not 16 bytes");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(8144 - 48, 1);
+
+	// A lone 16-byte free block is too small for the free lists.
+	sf_free(y);
+	assert_free_block_count(0, 1);
+	sf_free(x);
+	assert_free_block_count(0, 2);
+	assert_free_block_count(32, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, compact_fragment_listed_after_neighbour_freed, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	/* void *w = */ sf_malloc(8);
+	void *x = sf_malloc(8);
+	void *y = sf_malloc(8);
+	/* void *z = */ sf_malloc(8);
+	sf_free(x);
+	struct sf_snapshot_report report;
+	analyze_snapshot(&report);
+	cr_assert(report.fragment_blocks == 1 && report.unlisted_blocks == 0, "Fragment not reported as one");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(16, 0);
+
+	// Freeing the neighbour after it makes a 32-byte block that can be listed.
+	sf_free(y);
+	assert_free_block_count(0, 2);
+	assert_free_block_count(32, 1);
+	cr_assert(sf_free_list_heads[0].body.links.next == x - 8, "Merged block not at the fragment");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, compact_moves_long_lived_cursor, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(8);
+	void *y = sf_malloc(24);
+	/* void *z = */ sf_malloc(8);
+	sf_free(y);
+	void *big = sf_malloc_hint(1000, SF_HINT_LONG); // Leaves the cursor on y's block
+	sf_handle h = sf_halloc(24);
+	sf_block *h_block = sf_hlock(h) - 8;
+	cr_assert(h_block == y - 8, "Handle block not where y was");
+	h_block->body.links.next = (void *) 48; // Reads like a free block header 16 bytes in
+	sf_hunlock(h);
+	sf_free(x); // A 16-byte fragment right below the handle block
+
+	sf_compact();
+	cr_assert(sf_hlock(h) == x, "Handle block was not moved down");
+	sf_hunlock(h);
+	void *w = sf_malloc_hint(24, SF_HINT_LONG);
+	cr_assert(w == big + (((sf_block *) (big - 8))->header & ~(0xF)), "Long-lived block not at the lowest fit");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+#endif
+
+Test(sfmm_basecode_suite, trace_records_calls, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	int fds[2];
+	cr_assert(pipe(fds) == 0, "Could not create trace pipe!");
+	cr_assert(sf_trace_start(fds[1]) == 0, "sf_trace_start failed!");
+	void *x = sf_malloc(100);
+	void *y = sf_realloc(x, 300);
+	void *z = sf_memalign(50, 64);
+	sf_free(y);
+	cr_assert(sf_trace_stop() == 0, "sf_trace_stop failed!");
+	close(fds[1]);
+
+	// sf_realloc and sf_memalign call sf_malloc and sf_free internally, which must not be recorded.
+	struct sf_trace_record records[5];
+	cr_assert(read(fds[0], records, sizeof(records)) == 4 * sizeof(records[0]), "Wrong number of records!");
+	cr_assert(records[0].op == SF_TRACE_MALLOC && records[0].size == 100, "Wrong malloc record!");
+	cr_assert(records[0].result == (uint64_t) (x - sf_mem_start()), "Wrong malloc result!");
+	cr_assert(records[1].op == SF_TRACE_REALLOC && records[1].arg == records[0].result, "Wrong realloc record!");
+	cr_assert(records[1].result == (uint64_t) (y - sf_mem_start()), "Wrong realloc result!");
+	cr_assert(records[2].op == SF_TRACE_MEMALIGN && records[2].arg == 64, "Wrong memalign record!");
+	cr_assert(records[2].result == (uint64_t) (z - sf_mem_start()), "Wrong memalign result!");
+	cr_assert(records[3].op == SF_TRACE_FREE && records[3].arg == records[1].result, "Wrong free record!");
+	cr_assert(records[0].timestamp <= records[3].timestamp, "Timestamps out of order!");
+	close(fds[0]);
+}
+
+Test(sfmm_basecode_suite, malloc_class_matches_malloc, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert(SF_BLOCK_SIZE(1) == calculate_aligned_block_size(1), "Wrong constant block size!");
+	cr_assert(SF_BLOCK_SIZE(100) == calculate_aligned_block_size(100), "Wrong constant block size!");
+	cr_assert(SF_SIZE_CLASS(SF_BLOCK_SIZE(100)) == get_size_class(112), "Wrong constant size class!");
+	cr_assert(SF_SIZE_CLASS(SF_BLOCK_SIZE(1000)) == get_size_class(1008), "Wrong constant size class!");
+
+	void *x = sf_malloc(200);
+	/* void *y = */ sf_malloc(8);
+	sf_free(x);
+	void *z = sf_malloc_class(150, SF_BLOCK_SIZE(150), SF_SIZE_CLASS(SF_BLOCK_SIZE(150)));
+	cr_assert(z == x, "Freed block of the size class not reused");
+	assert_free_block_count(0, 2);
+	assert_free_block_count(48, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, size_classes_adapt_to_hot_sizes, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *blocks[16] = { NULL };
+	for (int i = 0; i < 5000; i++) { // Enough allocations for a rebuild, all of them 72 bytes (80-byte blocks)
+		if (blocks[i % 16] != NULL) {
+			sf_free(blocks[i % 16]);
+		}
+		blocks[i % 16] = sf_malloc(72);
+	}
+	int hot_class = get_size_class(80);
+	cr_assert(hot_class != get_size_class(64) && hot_class != get_size_class(96), "80-byte blocks have no class of their own");
+
+	void *x = blocks[3];
+	sf_free(x);
+	sf_block *bp = sf_free_list_heads[hot_class].body.links.next;
+	cr_assert(bp == x - 8, "Freed hot-size block not in its exact-fit list");
+	cr_assert(sf_malloc(72) == x, "Exact-fit block not reused");
+
+	void *y = sf_malloc(120); // A 128-byte block at the head of the list 80 used to be in
+	/* void *z = */ sf_malloc(8);
+	sf_free(y);
+	sf_free(x);
+	cr_assert(sf_malloc_class(72, SF_BLOCK_SIZE(72), SF_SIZE_CLASS(SF_BLOCK_SIZE(72))) == x, "Stale compile-time size class used");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+static int pressure_calls = 0;
+static size_t pressure_trim_hint = 0;
+
+static void free_cache(struct sf_pressure_info *info, void *arg) {
+	void **cache = arg;
+	pressure_calls++;
+	pressure_trim_hint = info->trim_hint;
+	if (*cache != NULL) {
+		sf_free(*cache);
+		*cache = NULL;
+	}
+}
+
+Test(sfmm_basecode_suite, soft_limit_calls_pressure_callback, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *cache = sf_malloc(4000);
+	cr_assert(sf_set_memory_limit(PAGE_SZ, 0) == 0, "sf_set_memory_limit failed!");
+	cr_assert(sf_register_pressure_callback(free_cache, &cache) == 0, "sf_register_pressure_callback failed!");
+
+	// Does not fit next to the cache, but fits once the callback frees it.
+	void *x = sf_malloc(6000);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(pressure_calls == 1, "Pressure callback not called once");
+	cr_assert(pressure_trim_hint == PAGE_SZ, "Wrong trim hint");
+	cr_assert(cache == NULL, "Cache not freed");
+	cr_assert(sf_mem_start() + PAGE_SZ == sf_mem_end(), "Heap grew past the soft limit");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, trace_records_pressure_callback_frees, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *cache = sf_malloc(4000);
+	cr_assert(sf_set_memory_limit(PAGE_SZ, 0) == 0, "sf_set_memory_limit failed!");
+	cr_assert(sf_register_pressure_callback(free_cache, &cache) == 0, "sf_register_pressure_callback failed!");
+	int fds[2];
+	cr_assert(pipe(fds) == 0, "Could not create trace pipe!");
+	uint64_t cache_offset = cache - sf_mem_start();
+	cr_assert(sf_trace_start(fds[1]) == 0, "sf_trace_start failed!");
+	void *x = sf_malloc(6000);
+	cr_assert(sf_trace_stop() == 0, "sf_trace_stop failed!");
+	close(fds[1]);
+
+	// The callback's sf_free happens inside sf_malloc, so it comes first.
+	struct sf_trace_record records[3];
+	cr_assert(read(fds[0], records, sizeof(records)) == 2 * sizeof(records[0]), "Wrong number of records!");
+	cr_assert(records[0].op == SF_TRACE_FREE && records[0].arg == cache_offset, "Callback free not recorded!");
+	cr_assert(records[1].op == SF_TRACE_MALLOC && records[1].result == (uint64_t) (x - sf_mem_start()),
+		"Wrong malloc record!");
+	close(fds[0]);
+}
+
+Test(sfmm_basecode_suite, hard_limit_fails_allocation, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert(sf_set_memory_limit(0, 2 * PAGE_SZ) == 0, "sf_set_memory_limit failed!");
+	void *x = sf_malloc(10000);
+	cr_assert_not_null(x, "x is NULL!");
+	void *y = sf_malloc(10000);
+	cr_assert_null(y, "y is not NULL!");
+	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+	cr_assert(sf_mem_start() + 2 * PAGE_SZ == sf_mem_end(), "Heap grew past the hard limit");
+	cr_assert(sf_set_memory_limit(PAGE_SZ, 1) == -1 && sf_errno == EINVAL, "Soft limit above hard limit accepted");
+}
+
+Test(sfmm_basecode_suite, compact_slides_handles, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_handle h1 = sf_halloc(200);
+	sf_handle h2 = sf_halloc(200);
+	sf_handle h3 = sf_halloc(200);
+	cr_assert(h1 != NULL && h2 != NULL && h3 != NULL, "sf_halloc failed!");
+	memset(sf_hlock(h2), 'b', 200);
+	sf_hunlock(h2);
+	memset(sf_hlock(h3), 'c', 200);
+	sf_hunlock(h3);
+	sf_hfree(h1);
+	assert_free_block_count(0, 2);
+
+	size_t free_tail = sf_compact();
+	cr_assert(free_tail == 7728, "Wrong free space at the end of the heap (exp=7728, found=%zu)", free_tail);
+	assert_free_block_count(0, 1);
+	char *b = sf_hlock(h2);
+	char *c = sf_hlock(h3);
+	cr_assert(b == sf_mem_start() + 48 && c == b + 208, "Handle blocks were not moved down");
+	for (int i = 0; i < 200; i++) {
+		cr_assert(b[i] == 'b' && c[i] == 'c', "Contents were not moved with the blocks");
+	}
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, compact_keeps_locked_handles, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_handle h1 = sf_halloc(200);
+	sf_handle h2 = sf_halloc(200);
+	sf_handle h3 = sf_halloc(200);
+	sf_handle h4 = sf_halloc(200);
+	void *locked = sf_hlock(h2);
+	sf_hfree(h1);
+	sf_hfree(h3);
+
+	size_t free_tail = sf_compact();
+	cr_assert(free_tail == 7520, "Wrong free space at the end of the heap (exp=7520, found=%zu)", free_tail);
+	cr_assert(sf_hlock(h2) == locked, "A locked handle block was moved");
+	cr_assert(sf_hlock(h4) == locked + 208, "An unlocked handle block was not moved");
+	assert_free_block_count(208, 1);
+	assert_free_block_count(0, 2);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, cache_colouring_offsets_large_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_set_cache_colouring(1024);
+	char *x = sf_malloc(2000);
+	char *y = sf_malloc(2000);
+	void *small = sf_malloc(100);
+	cr_assert(y == x + 2016 + 64, "Second large block is not offset by one cache line");
+	cr_assert(valid_pointer(y), "Coloured pointer is not valid");
+	memset(y, 'y', 2000);
+
+	char *z = sf_realloc(y, 3000);
+	cr_assert(z != NULL, "sf_realloc of a coloured block failed!");
+	for (int i = 0; i < 2000; i++) {
+		cr_assert(z[i] == 'y', "Contents were not copied by sf_realloc");
+	}
+	void *aligned = sf_memalign(3000, 4096);
+	cr_assert((uintptr_t) aligned % 4096 == 0, "sf_memalign block was coloured");
+
+	sf_free(x);
+	sf_free(z);
+	sf_free(small);
+	sf_free(aligned);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, colour_base_needs_colour_magic, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_set_cache_colouring(1024);
+	/* void *x = */ sf_malloc(2000);
+	char *y = sf_malloc(2000); // Coloured by one cache line
+	char *plain = sf_malloc(200);
+	cr_assert(colour_base(y) == y - 64, "Coloured pointer not rebased");
+
+	// Payload words that look like a colour offset do not make a pointer coloured.
+	*(uint64_t *) plain = 64;
+	*(uint64_t *) (plain + 64 - 8) = 64 | SF_COLOUR_MARK;
+	cr_assert(colour_base(plain + 64) == plain + 64, "Uncoloured block rebased");
+	cr_assert(!valid_pointer(plain + 64), "Pointer into an uncoloured block is valid");
+	*(uint64_t *) (y + 128 - 8) = 192 | SF_COLOUR_MARK;
+	cr_assert(colour_base(y + 128) == y + 128, "Pointer into a coloured block rebased");
+	cr_assert(!valid_pointer(y + 128), "Pointer into a coloured block is valid");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, free_deferred_waits_for_readers, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert(sf_epoch_enter() == 0, "sf_epoch_enter failed!");
+	void *x = sf_malloc(100);
+	cr_assert(sf_free_deferred(x) == 0, "sf_free_deferred failed!");
+	sf_epoch_reclaim();
+	cr_assert(valid_pointer(x), "Block was freed while a reader was inside a traversal");
+	sf_epoch_exit();
+
+	sf_epoch_reclaim();
+	cr_assert(!valid_pointer(x), "Block was not freed after the reader left");
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, huge_pages_grow_whole_segments, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_set_huge_pages(1);
+	void *x = sf_malloc(9000);
+	cr_assert(x != NULL, "sf_malloc failed with huge pages on!");
+	size_t heap_size = sf_mem_end() - sf_mem_start();
+	uintptr_t end = (uintptr_t) sf_mem_end(); /* The heap start is not page aligned */
+	cr_assert(end / SF_SEGMENT_SIZE != (end - PAGE_SZ) / SF_SEGMENT_SIZE || heap_size == 16 * PAGE_SZ,
+		"Heap stopped growing before the segment boundary"); /* sf_mem_grow stops at 16 pages */
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+
+	struct sf_huge_page_stats stats;
+	cr_assert(sf_huge_page_stats(&stats) == 0, "sf_huge_page_stats failed!");
+	cr_assert(stats.heap_size == heap_size, "Wrong heap size in huge page stats");
+	cr_assert(stats.mapping_size >= heap_size, "Mapping smaller than the heap");
+	cr_assert(stats.mapping_huge_page_bytes <= stats.mapping_size, "More huge page bytes than mapping");
+	sf_free(x);
+	assert_free_block_count(0, 1);
+}
+
+Test(sfmm_basecode_suite, purge_releases_idle_pages, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(100);
+	char *y = sf_malloc(24000);
+	void *z = sf_malloc(100);
+	memset(y, 'y', 24000);
+	sf_free(y);
+	cr_assert(sf_purge(60 * 60 * 1000) == 0, "Purged a block that has not been idle long enough");
+	cr_assert(sf_purge(0) >= 16384, "Whole pages of the free block were not purged");
+	cr_assert(sf_purge(0) == 0, "Purged the same pages twice");
+	assert_free_block_count(24016, 1);
+
+	char *w = sf_malloc(24000);
+	cr_assert(w == y, "Purged block was not reused");
+	int zeroed = 0;
+	for (int i = 0; i < 24000; i++) {
+		zeroed += w[i] == 0;
+	}
+	cr_assert(zeroed >= 16384, "Purged pages did not come back zeroed");
+	sf_free(x);
+	sf_free(w);
+	sf_free(z);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, purge_decay_runs_from_free, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_set_purge_decay(0);
+	void *x = sf_malloc(100);
+	char *y = sf_malloc(24000);
+	void *z = sf_malloc(100);
+	memset(y, 'y', 24000);
+	sf_free(y);
+	for (int i = 0; i < SF_PURGE_INTERVAL; i++) {
+		sf_free(sf_malloc(16));
+	}
+	char *w = sf_malloc(24000);
+	cr_assert(w == y, "Purged block was not reused");
+	cr_assert(w[12000] == 0, "Idle pages were not purged by sf_free");
+	sf_free(x);
+	sf_free(w);
+	sf_free(z);
+	sf_set_purge_decay(-1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, free_sized_frees_plain_and_aligned, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(200);
+	void *y = sf_memalign(100, 256);
+	void *z = sf_malloc(50);
+	sf_free_sized(x, 200);
+	sf_free_sized(y, 100);
+	cr_assert(!valid_pointer(x) && !valid_pointer(y), "Blocks are still allocated");
+	sf_free_sized(z, 50);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, free_sized_frees_coloured_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_set_cache_colouring(1024);
+	void *x = sf_malloc(2000);
+	void *y = sf_malloc(2000); // Coloured by one cache line
+	void *z = sf_malloc(100);
+	cr_assert(colour_base(y) != y, "y is not coloured");
+	sf_set_cache_colouring(0); // Blocks coloured before still are
+	sf_free_sized(y, 2000);
+	sf_free_sized(z, 100);
+	sf_free_sized(x, 2000);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+#ifdef SF_THREADS
+static void *malloc_free_class(void *arg) {
+	size_t size = (size_t) arg;
+	void *blocks[16];
+	for (int round = 0; round < 2000; round++) {
+		for (int i = 0; i < 16; i++) {
+			blocks[i] = sf_malloc(size);
+			if (blocks[i] == NULL) {
+				return "sf_malloc failed";
+			}
+			memset(blocks[i], i, size);
+		}
+		for (int i = 0; i < 16; i++) {
+			for (size_t j = 0; j < size; j++) {
+				if (((unsigned char *) blocks[i])[j] != i) {
+					return "Block was overwritten";
+				}
+			}
+			sf_free(blocks[i]);
+		}
+	}
+	return NULL;
+}
+
+Test(sfmm_basecode_suite, threads_malloc_free, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	size_t sizes[4] = { 20, 100, 200, 700 }; /* One size class each */
+	pthread_t threads[4];
+	void *result;
+	for (int i = 0; i < 4; i++) {
+		cr_assert(pthread_create(&threads[i], NULL, malloc_free_class, (void *) sizes[i]) == 0,
+			"Could not create thread!");
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(threads[i], &result);
+		cr_assert(result == NULL, "%s", (char *) result);
+	}
+	// Everything coalesces back into the wilderness.
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+static void *malloc_free_small(void *arg) {
+	void *x = sf_malloc(20);
+	if (x == NULL) {
+		return "sf_malloc failed";
+	}
+	sf_free(x);
+	__atomic_store_n((int *) arg, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+Test(sfmm_basecode_suite, threads_other_lists_locked, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(20);
+	void *y = sf_malloc(20);
+	sf_free(x); /* Leaves a fit on the smallest list */
+	int done = 0;
+	pthread_t thread;
+	void *result;
+	for (int i = NUM_FREE_LISTS - 1; i > 0; i--) {
+		lock_list(i);
+	}
+	cr_assert(pthread_create(&thread, NULL, malloc_free_small, &done) == 0, "Could not create thread!");
+	for (int i = 0; i < 1000 && !__atomic_load_n(&done, __ATOMIC_ACQUIRE); i++) {
+		sched_yield();
+	}
+	for (int i = 0; i < 5 && !__atomic_load_n(&done, __ATOMIC_ACQUIRE); i++) {
+		sleep(1); /* Waits longer on a busy machine */
+	}
+	int finished = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+	for (int i = 1; i < NUM_FREE_LISTS; i++) {
+		unlock_list(i);
+	}
+	pthread_join(thread, &result);
+	cr_assert(result == NULL, "%s", (char *) result);
+	cr_assert(finished, "Allocating from one list waited on the others");
+	sf_free(y);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+static void *retire_and_exit(void *arg) {
+	if (sf_epoch_enter() != 0) {
+		return "sf_epoch_enter failed";
+	}
+	void *x = sf_malloc(100);
+	if (x == NULL || sf_free_deferred(x) != 0) {
+		return "sf_free_deferred failed";
+	}
+	return NULL; /* Exits inside the traversal, with x still retired */
+}
+
+Test(sfmm_basecode_suite, threads_epoch_slots_released_at_exit, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *result;
+	for (int i = 0; i < 2 * SF_MAX_EPOCH_THREADS; i++) {
+		pthread_t thread;
+		cr_assert(pthread_create(&thread, NULL, retire_and_exit, NULL) == 0, "Could not create thread!");
+		pthread_join(thread, &result);
+		cr_assert(result == NULL, "Thread %d: %s", i, (char *) result);
+	}
+	// What the threads retired was handed over and is freed here.
+	sf_epoch_reclaim();
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+static void *free_blocks_and_exit(void *arg) {
+	void **blocks = arg;
+	for (int i = 0; i < 4; i++) {
+		sf_free(blocks[i]);
+	}
+	return NULL; /* Its records are written out as it exits, before this thread's */
+}
+
+Test(sfmm_basecode_suite, threads_trace_decodes_in_timestamp_order, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	int fds[2];
+	FILE *decoded = tmpfile();
+	cr_assert(pipe(fds) == 0 && decoded != NULL, "Could not create trace files!");
+	cr_assert(sf_trace_start(fds[1]) == 0, "sf_trace_start failed!");
+	void *blocks[4];
+	for (int i = 0; i < 4; i++) {
+		blocks[i] = sf_malloc(100);
+	}
+	pthread_t thread;
+	cr_assert(pthread_create(&thread, NULL, free_blocks_and_exit, blocks) == 0, "Could not create thread!");
+	pthread_join(thread, NULL);
+	cr_assert(sf_trace_stop() == 0, "sf_trace_stop failed!");
+	close(fds[1]);
+
+	cr_assert(sf_trace_decode(fds[0], decoded) == 0, "sf_trace_decode failed!");
+	rewind(decoded);
+	char line[64];
+	for (int i = 0; i < 8; i++) {
+		char expected[64];
+		snprintf(expected, sizeof(expected), i < 4 ? "a %d 100\n" : "f %d\n", i % 4);
+		cr_assert(fgets(line, sizeof(line), decoded) != NULL && strcmp(line, expected) == 0,
+			"Line %d is not %s", i, expected);
+	}
+	cr_assert(fgets(line, sizeof(line), decoded) == NULL, "Extra requests decoded");
+	close(fds[0]);
+	fclose(decoded);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+#endif
@@ -0,0 +1,104 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+#include "sfmm.hpp"
+
+/*
+ * Container benchmark (make cppbench).  Runs the same std::vector and std::map workloads
+ * with std::allocator, sfmm::allocator and sfmm::memory_resource and prints the time of
+ * each.  Every workload keeps its live data well below the 128 KiB the heap can grow to.
+ */
+#define BENCH_ROUNDS 2000
+#define VECTOR_ELEMENTS 2000
+#define MAP_ENTRIES 500
+#define ALIGNED_ELEMENTS 200
+
+struct alignas(64) cache_line {
+    long value;
+    char pad[56];
+};
+
+static long checksum = 0;
+
+template <typename Vector>
+static void vector_push(Vector &&make) {
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        auto vector = make();
+        for (int i = 0; i < VECTOR_ELEMENTS; i++) {
+            vector.push_back(i);
+        }
+        checksum += vector[round % VECTOR_ELEMENTS];
+    }
+}
+
+template <typename Map>
+static void map_churn(Map &&make) {
+    unsigned int random = 12345;
+    for (int round = 0; round < BENCH_ROUNDS / 10; round++) {
+        auto map = make();
+        for (int i = 0; i < MAP_ENTRIES; i++) {
+            random = random * 1103515245 + 12345;
+            map[(random >> 8) % (MAP_ENTRIES * 4)] = i;
+        }
+        for (int i = 0; i < MAP_ENTRIES * 4; i += 2) {
+            map.erase(i);
+        }
+        checksum += map.size();
+    }
+}
+
+template <typename Vector>
+static void aligned_push(Vector &&make) {
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        auto vector = make();
+        for (int i = 0; i < ALIGNED_ELEMENTS; i++) {
+            vector.push_back(cache_line{i, {}});
+        }
+        checksum += vector.back().value;
+    }
+}
+
+template <typename Workload>
+static double time_ms(Workload &&workload) {
+    auto start = std::chrono::steady_clock::now();
+    workload();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static void report(const char *name, double std_ms, double allocator_ms, double resource_ms) {
+    printf("%-14s %12.2f %12.2f %12.2f\n", name, std_ms, allocator_ms, resource_ms);
+}
+
+int main() {
+    std::pmr::memory_resource *resource = sfmm::get_memory_resource();
+    printf("%-14s %12s %12s %12s\n", "ms", "std", "sfmm", "sfmm::pmr");
+
+    report("vector_push",
+        time_ms([] { vector_push([] { return std::vector<int>(); }); }),
+        time_ms([] { vector_push([] { return std::vector<int, sfmm::allocator<int>>(); }); }),
+        time_ms([&] { vector_push([&] { return std::pmr::vector<int>(resource); }); }));
+
+    report("map_churn",
+        time_ms([] { map_churn([] { return std::map<int, int>(); }); }),
+        time_ms([] {
+            map_churn([] {
+                return std::map<int, int, std::less<int>, sfmm::allocator<std::pair<const int, int>>>();
+            });
+        }),
+        time_ms([&] { map_churn([&] { return std::pmr::map<int, int>(resource); }); }));
+
+    report("aligned_push",
+        time_ms([] { aligned_push([] { return std::vector<cache_line>(); }); }),
+        time_ms([] { aligned_push([] { return std::vector<cache_line, sfmm::allocator<cache_line>>(); }); }),
+        time_ms([&] { aligned_push([&] { return std::pmr::vector<cache_line>(resource); }); }));
+
+    printf("checksum %ld\n", checksum);
+
+    return EXIT_SUCCESS;
+
+}
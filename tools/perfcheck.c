@@ -0,0 +1,361 @@
+#define _POSIX_C_SOURCE 200112L /* clock_gettime, fork, getopt */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Performance regression gate (make perfcheck).  Runs each workload below in a child
+ * process of its own, so every run starts from an empty heap, and compares the results
+ * with two JSON baselines:
+ *
+ *   throughput    operations per second, best of PERF_RUNS runs            (local)
+ *   p99_ns        99th percentile latency of one operation, best of runs   (local)
+ *   peak_heap     heap size at the end of the workload                     (shared)
+ *   utilization   peak bytes requested and live at once / peak_heap        (shared)
+ *
+ * The shared metrics are the same on every machine and live in a baseline kept under
+ * version control.  The timing metrics only compare with earlier runs on the same
+ * machine, so they go to a local baseline that is recorded by the first run that does
+ * not find one.  A metric more than the tolerance (percent) worse than its baseline
+ * fails the check.  With -u both baselines are written instead (make perfbaseline).
+ */
+#define PERF_RUNS 5
+#define PERF_OPS 200000
+#define PERF_SLOTS 256
+#define DEFAULT_TOLERANCE 20.0
+
+enum { THROUGHPUT, P99_NS, PEAK_HEAP, UTILIZATION, NUM_METRICS };
+
+struct perf_result {
+    double values[NUM_METRICS];
+};
+
+struct metric {
+    const char *key;
+    const char *format;
+    int higher_is_better;
+    int local; /* Depends on the machine, so kept out of the shared baseline */
+};
+
+static const struct metric metrics[NUM_METRICS] = {
+    [THROUGHPUT] = { "throughput", "%.0f", 1, 1 },
+    [P99_NS] = { "p99_ns", "%.0f", 0, 1 },
+    [PEAK_HEAP] = { "peak_heap", "%.0f", 0, 0 },
+    [UTILIZATION] = { "utilization", "%.4f", 1, 0 },
+};
+
+struct workload {
+    const char *name;
+    void (*run)(int op, unsigned int random);
+};
+
+static void *slots[PERF_SLOTS];
+static size_t slot_sizes[PERF_SLOTS];
+static size_t live_bytes, peak_live_bytes;
+static long latencies[PERF_OPS];
+
+static void slot_set(int i, void *ptr, size_t size) {
+    live_bytes -= slot_sizes[i];
+    slots[i] = ptr;
+    slot_sizes[i] = ptr == NULL ? 0 : size;
+    live_bytes += slot_sizes[i];
+    if (live_bytes > peak_live_bytes) {
+        peak_live_bytes = live_bytes;
+    }
+}
+
+/* Random small blocks freed in random order. */
+static void small_churn(int op, unsigned int random) {
+    int i = random % PERF_SLOTS;
+    if (slots[i] != NULL) {
+        sf_free(slots[i]);
+        slot_set(i, NULL, 0);
+    } else {
+        size_t size = 1 + (random >> 8) % 128;
+        slot_set(i, sf_malloc(size), size);
+    }
+}
+
+/* Sizes spread over every size class. */
+static void mixed_sizes(int op, unsigned int random) {
+    int i = random % (PERF_SLOTS / 4);
+    if (slots[i] != NULL) {
+        sf_free(slots[i]);
+        slot_set(i, NULL, 0);
+    } else {
+        size_t size = 1 + ((random >> 8) % 1024 >> ((random >> 20) % 6));
+        slot_set(i, sf_malloc(size), size);
+    }
+}
+
+/* Blocks grown with sf_realloc until they are freed. */
+static void realloc_growth(int op, unsigned int random) {
+    int i = random % (PERF_SLOTS / 8);
+    if (slot_sizes[i] > 1000) {
+        sf_free(slots[i]);
+        slot_set(i, NULL, 0);
+    } else {
+        size_t size = slot_sizes[i] + 16 + (random >> 8) % 48;
+        void *ptr = sf_realloc(slots[i] == NULL ? sf_malloc(1) : slots[i], size);
+        slot_set(i, ptr, size);
+    }
+}
+
+/* A queue: every block is freed in allocation order. */
+static void fifo(int op, unsigned int random) {
+    int i = op % PERF_SLOTS;
+    if (slots[i] != NULL) {
+        sf_free(slots[i]);
+    }
+    size_t size = 64 + (random >> 8) % 137;
+    slot_set(i, sf_malloc(size), size);
+}
+
+/* Cache-line and larger alignments. */
+static void aligned(int op, unsigned int random) {
+    int i = random % (PERF_SLOTS / 8);
+    if (slots[i] != NULL) {
+        sf_free(slots[i]);
+        slot_set(i, NULL, 0);
+    } else {
+        size_t size = 1 + (random >> 8) % 512;
+        slot_set(i, sf_memalign(size, 64 << (random >> 20) % 3), size);
+    }
+}
+
+static struct workload workloads[] = {
+    { "small_churn", small_churn },
+    { "mixed_sizes", mixed_sizes },
+    { "realloc_growth", realloc_growth },
+    { "fifo", fifo },
+    { "aligned", aligned },
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static long elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L + end->tv_nsec - start->tv_nsec;
+}
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_workload(struct workload *workload, struct perf_result *result) {
+    unsigned int random = 12345; /* Every run replays the same requests */
+    struct timespec start, end, op_start, op_end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int op = 0; op < PERF_OPS; op++) {
+        random = random * 1103515245 + 12345;
+        clock_gettime(CLOCK_MONOTONIC, &op_start);
+        workload->run(op, random >> 1);
+        clock_gettime(CLOCK_MONOTONIC, &op_end);
+        latencies[op] = elapsed_ns(&op_start, &op_end);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    qsort(latencies, PERF_OPS, sizeof(latencies[0]), compare_longs);
+    double *values = result->values;
+    values[THROUGHPUT] = PERF_OPS / (elapsed_ns(&start, &end) / 1e9);
+    values[P99_NS] = latencies[PERF_OPS * 99 / 100];
+    values[PEAK_HEAP] = sf_mem_end() - sf_mem_start();
+    values[UTILIZATION] = values[PEAK_HEAP] > 0 ? peak_live_bytes / values[PEAK_HEAP] : 0;
+}
+
+/* Runs a workload in a child process and reads its result back through a pipe. */
+static int measure(struct workload *workload, struct perf_result *result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        run_workload(workload, result);
+        _exit(write_fully(fds[1], result, sizeof(*result)) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    int status;
+    int failed = read_fully(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    if (failed || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "%s: workload did not finish\n", workload->name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Finds "key": <number> inside the baseline object of one workload. */
+static int json_number(const char *json, const char *workload, const char *key, double *value) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", workload);
+    const char *object = strstr(json, pattern);
+    if (object == NULL || (object = strchr(object, '{')) == NULL) {
+        return -1;
+    }
+    const char *object_end = strchr(object, '}');
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    const char *field = strstr(object, pattern);
+    if (field == NULL || field > object_end || (field = strchr(field, ':')) == NULL) {
+        return -1;
+    }
+    return sscanf(field + 1, "%lf", value) == 1 ? 0 : -1;
+}
+
+static char *read_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    size_t len = 0, capacity = 4096;
+    char *contents = malloc(capacity);
+    size_t count;
+    while (contents != NULL && (count = fread(contents + len, 1, capacity - len - 1, file)) > 0) {
+        len += count;
+        if (len + 1 == capacity) {
+            contents = realloc(contents, capacity *= 2);
+        }
+    }
+    fclose(file);
+    if (contents != NULL) {
+        contents[len] = '\0';
+    }
+    return contents;
+}
+
+/* Writes the local or the shared metrics of every workload to a baseline file. */
+static int write_baseline(const char *path, struct perf_result *results, int local) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(file, "{\n");
+    for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+        fprintf(file, "  \"%s\": {", workloads[i].name);
+        const char *separator = "";
+        for (int m = 0; m < NUM_METRICS; m++) {
+            if (metrics[m].local == local) {
+                fprintf(file, "%s\"%s\": ", separator, metrics[m].key);
+                fprintf(file, metrics[m].format, results[i].values[m]);
+                separator = ", ";
+            }
+        }
+        fprintf(file, "}%s\n", i + 1 < NUM_WORKLOADS ? "," : "");
+    }
+    fprintf(file, "}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+/* Prints one metric and returns 1 if it regressed. */
+static int check_metric(const char *json, const char *workload, const struct metric *metric,
+    double current, double tolerance) {
+    double baseline;
+    if (json_number(json, workload, metric->key, &baseline)) {
+        printf("  %-12s %14.2f  (no baseline)\n", metric->key, current);
+        return 1;
+    }
+    double change = baseline == 0 ? 0 : (current - baseline) / baseline * 100;
+    int regressed = metric->higher_is_better ? change < -tolerance : change > tolerance;
+    printf("  %-12s %14.2f  baseline %14.2f  %+7.1f%%%s\n", metric->key, current, baseline, change,
+        regressed ? "  REGRESSION" : "");
+    return regressed;
+}
+
+#define USAGE "usage: %s [-u] [-t tolerance_percent] baseline.json local_baseline.json\n"
+
+int main(int argc, char *argv[]) {
+    int update = 0;
+    double tolerance = DEFAULT_TOLERANCE;
+    int opt;
+    while ((opt = getopt(argc, argv, "ut:")) != -1) {
+        if (opt == 'u') {
+            update = 1;
+        } else if (opt == 't') {
+            tolerance = atof(optarg);
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 2 != argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *baseline_path = argv[optind];
+    const char *local_path = argv[optind + 1];
+
+    struct perf_result results[NUM_WORKLOADS];
+    for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+        double *best = results[i].values;
+        for (int run = 0; run < PERF_RUNS; run++) {
+            struct perf_result result;
+            if (measure(&workloads[i], &result)) {
+                return EXIT_FAILURE;
+            }
+            if (run == 0 || result.values[THROUGHPUT] > best[THROUGHPUT]) {
+                best[THROUGHPUT] = result.values[THROUGHPUT];
+            }
+            if (run == 0 || result.values[P99_NS] < best[P99_NS]) {
+                best[P99_NS] = result.values[P99_NS];
+            }
+            best[PEAK_HEAP] = result.values[PEAK_HEAP];
+            best[UTILIZATION] = result.values[UTILIZATION];
+        }
+    }
+
+    if (update) {
+        if (write_baseline(baseline_path, results, 0) || write_baseline(local_path, results, 1)) {
+            return EXIT_FAILURE;
+        }
+        printf("wrote %s and %s\n", baseline_path, local_path);
+        return EXIT_SUCCESS;
+    }
+
+    char *json = read_file(baseline_path);
+    if (json == NULL) {
+        fprintf(stderr, "%s: no baseline, run make perfbaseline first\n", baseline_path);
+        return EXIT_FAILURE;
+    }
+    char *local_json = read_file(local_path);
+    if (local_json == NULL) { /* First run on this machine */
+        if (write_baseline(local_path, results, 1)) {
+            free(json);
+            return EXIT_FAILURE;
+        }
+        printf("recorded the timing baseline for this machine in %s\n", local_path);
+    }
+    int regressions = 0;
+    for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+        const char *name = workloads[i].name;
+        printf("%s\n", name);
+        for (int m = 0; m < NUM_METRICS; m++) {
+            if (metrics[m].local && local_json == NULL) {
+                continue; /* Nothing to compare with yet */
+            }
+            regressions += check_metric(metrics[m].local ? local_json : json, name, &metrics[m],
+                results[i].values[m], tolerance);
+        }
+    }
+    free(json);
+    free(local_json);
+    if (regressions > 0) {
+        printf("perfcheck: %d metric(s) regressed by more than %.1f%%\n", regressions, tolerance);
+        return EXIT_FAILURE;
+    }
+    printf("perfcheck: ok (tolerance %.1f%%)\n", tolerance);
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Reads a binary allocation trace written by sf_trace_start() from the file named on the
+ * command line (or standard input) and prints it as a replayable text trace.
+ */
+int main(int argc, char const *argv[]) {
+    int fd = STDIN_FILENO;
+    if (argc > 1 && (fd = open(argv[1], O_RDONLY)) < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (sf_trace_decode(fd, stdout)) {
+        fprintf(stderr, "%s: not a valid allocation trace\n", argc > 1 ? argv[1] : "stdin");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sfmm.h"
+#include "my_sfmm.h"
+
+/*
+ * Reads a heap snapshot written by sf_heap_snapshot() from the file named on the
+ * command line (or standard input) and prints a fragmentation report.
+ */
+int main(int argc, char const *argv[]) {
+    int fd = STDIN_FILENO;
+    if (argc > 1 && (fd = open(argv[1], O_RDONLY)) < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    struct sf_snapshot_report report;
+    if (sf_snapshot_analyze(fd, &report)) {
+        fprintf(stderr, "%s: not a valid heap snapshot\n", argc > 1 ? argv[1] : "stdin");
+        return EXIT_FAILURE;
+    }
+    sf_snapshot_print_report(stdout, &report);
+
+    return EXIT_SUCCESS;
+
+}